@@ -0,0 +1,79 @@
+#ifndef DDB_OWS_CONCURRENCY_HPP
+#define DDB_OWS_CONCURRENCY_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "job.hpp"
+#include "jobsqueue.hpp"
+
+namespace ddb_ows {
+
+// Range of the number of jobs of a lane that may run at once
+struct lane_bounds_t {
+    unsigned int min;
+    unsigned int initial;
+    unsigned int max;
+};
+
+// Tunes how many jobs of each lane run at once while a sync progresses, by
+// hill climbing on the bytes the lane's jobs write per second: the limit keeps
+// moving in one direction while that pays off, and turns around when
+// throughput drops or an added job doesn't raise it. Windows in which jobs
+// barely waited in the queue are skipped, as the limit did not hold anything
+// back then. The best number of
+// conversions depends on the cores and the encoder, the best number of writers
+// on the destination device, and neither is known up front. The queue needs at
+// least bounds.max workers per lane.
+class ConcurrencyController {
+  public:
+    struct lane_summary_t {
+        unsigned int min;
+        unsigned int max;
+        unsigned int last;
+        // Average over time
+        double mean;
+    };
+
+    ConcurrencyController(
+        std::shared_ptr<JobsQueue> _jobs, const std::array<lane_bounds_t, N_JOB_LANES>& bounds
+    );
+
+    // Measures each lane's throughput and queue wait since its limit last
+    // changed, and changes the limit if enough jobs completed to tell. Call
+    // periodically.
+    void adjust();
+    lane_summary_t summary(job_lane lane) const;
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct lane_state_t {
+        lane_bounds_t bounds;
+        unsigned int limit;
+        // +1 or -1
+        int direction = 1;
+        // Throughput of the previous window, in bytes per second, 0 if unknown
+        double last_throughput = 0;
+        // Start of the current window
+        clock::time_point since;
+        JobsQueue::lane_stats_t stats_since;
+        unsigned int min_limit;
+        unsigned int max_limit;
+        // Integral of limit over time, in limit × seconds
+        double limit_seconds = 0;
+        clock::time_point start;
+        clock::time_point last_adjusted;
+    };
+
+    std::shared_ptr<JobsQueue> jobs;
+    std::array<lane_state_t, N_JOB_LANES> lanes;
+
+    void adjust(job_lane lane, lane_state_t& state);
+};
+
+}  // namespace ddb_ows
+
+#endif
@@ -8,6 +8,7 @@
 #include <unordered_set>
 #include <vector>
 
+#include "db_opts.hpp"
 #include "deadbeef/deadbeef.h"
 #include "playlist_uuid.hpp"
 
@@ -39,12 +40,79 @@ struct ddb_ows_config {
     bool cover_sync;
     std::string cover_fname;
     unsigned int cover_timeout_ms;
+    // Maximum number of cover requests awaiting a response at once
+    unsigned int cover_max_inflight;
     sync_pls_t sync_pls;
     bool rm_unref;
+    // Recognize sources that moved within the library by their contents, and
+    // move their destinations instead of copying them anew: "off", "sampled"
+    // (hash the head and tail of each file) or "full". Only sources synced
+    // while this was enabled can be recognized.
+    std::string rename_detection;
     std::set<std::string> conv_fts;
     std::string conv_preset;
     std::string conv_ext;
+    // Workers for conversions
     int conv_wts;
+    // "longest_first" or "fifo"
+    std::string conv_order;
+    // Conversions encode into this directory, and the I/O workers then copy
+    // the finished files to the destination. Ideally on a tmpfs or SSD. The
+    // system's temporary directory if empty.
+    std::string scratch_dir;
+    // Conversions pause while more converted files than this, or more MiB of
+    // them, wait to be installed. 0 means unlimited.
+    unsigned int scratch_max_files;
+    unsigned int scratch_max_mb;
+    // Encoded files are kept here, keyed by their source's contents, the
+    // preset and the tags, and reused instead of encoding again, e.g. when
+    // syncing the same library to several devices. Empty to disable.
+    std::string transcode_cache_dir;
+    // Least recently used files are evicted beyond this size
+    unsigned int transcode_cache_mb;
+    // Workers for copies, moves, deletions, and installing converted files
+    int io_wts;
+    // Start from conv_wts and io_wts, and tune both while syncing to maximize
+    // the bytes written per second
+    bool adaptive_wts;
+    // Niceness of all workers
+    int worker_nice;
+    // I/O scheduling class of all workers: "idle", "best-effort" or "none" to
+    // inherit it. Only honored by some I/O schedulers, e.g. BFQ.
+    std::string worker_io_class;
+    // Bandwidth and operations per second all workers may use together. 0
+    // means unlimited.
+    unsigned int io_limit_mbps;
+    unsigned int io_limit_iops;
+    // 0 means one planner thread per hardware thread
+    int plan_wts;
+    // Threads scanning the destination, each taking one top-level directory at
+    // a time
+    int scan_wts;
+    // Start executing jobs while they are still being planned
+    bool stream_jobs;
+    db_opts_t db_opts;
+    // "deferred": throttle writeback during the sync and sync the destination
+    // once at the end, or "none": leave it to the kernel
+    std::string durability;
+    // Maximum number of bytes copies may leave dirty in deferred mode; 0 for
+    // no limit
+    unsigned int dirty_budget_mb;
+    // How to materialize files that are not converted, if the root is on the
+    // same filesystem as the source: "copy", "hardlink" or "symlink". Falls
+    // back to copying otherwise.
+    std::string link_mode;
+    // "default" or "io_uring"
+    std::string copy_backend;
+    // Reads and writes io_uring keeps in flight per copy
+    unsigned int copy_queue_depth;
+    // Copies of files larger than this record their progress every this many
+    // MiB, so that they resume there when interrupted; 0 to always start over
+    unsigned int copy_checkpoint_mb;
+    // Existing destinations that differ from their source in at most this
+    // many KiB, e.g. because the source was retagged, are updated in place
+    // instead of copied anew; 0 to always copy in full
+    unsigned int delta_limit_kb;
 };
 
 class Configuration {
@@ -61,12 +129,37 @@ class Configuration {
     DDB_OWS_CONFIG_METHODS(cover_sync, bool)
     DDB_OWS_CONFIG_METHODS(cover_fname, std::string)
     DDB_OWS_CONFIG_METHODS(cover_timeout_ms, unsigned int)
+    DDB_OWS_CONFIG_METHODS(cover_max_inflight, unsigned int)
     DDB_OWS_CONFIG_METHODS(sync_pls, sync_pls_t)
     DDB_OWS_CONFIG_METHODS(rm_unref, bool)
+    DDB_OWS_CONFIG_METHODS(rename_detection, std::string)
     DDB_OWS_CONFIG_METHODS(conv_fts, std::set<std::string>)
     DDB_OWS_CONFIG_METHODS(conv_preset, std::string)
     DDB_OWS_CONFIG_METHODS(conv_ext, std::string)
     DDB_OWS_CONFIG_METHODS(conv_wts, int)
+    DDB_OWS_CONFIG_METHODS(conv_order, std::string)
+    DDB_OWS_CONFIG_METHODS(scratch_dir, std::string)
+    DDB_OWS_CONFIG_METHODS(scratch_max_files, unsigned int)
+    DDB_OWS_CONFIG_METHODS(scratch_max_mb, unsigned int)
+    DDB_OWS_CONFIG_METHODS(transcode_cache_dir, std::string)
+    DDB_OWS_CONFIG_METHODS(transcode_cache_mb, unsigned int)
+    DDB_OWS_CONFIG_METHODS(io_wts, int)
+    DDB_OWS_CONFIG_METHODS(adaptive_wts, bool)
+    DDB_OWS_CONFIG_METHODS(worker_nice, int)
+    DDB_OWS_CONFIG_METHODS(worker_io_class, std::string)
+    DDB_OWS_CONFIG_METHODS(io_limit_mbps, unsigned int)
+    DDB_OWS_CONFIG_METHODS(io_limit_iops, unsigned int)
+    DDB_OWS_CONFIG_METHODS(plan_wts, int)
+    DDB_OWS_CONFIG_METHODS(scan_wts, int)
+    DDB_OWS_CONFIG_METHODS(stream_jobs, bool)
+    DDB_OWS_CONFIG_METHODS(db_opts, db_opts_t)
+    DDB_OWS_CONFIG_METHODS(durability, std::string)
+    DDB_OWS_CONFIG_METHODS(dirty_budget_mb, unsigned int)
+    DDB_OWS_CONFIG_METHODS(link_mode, std::string)
+    DDB_OWS_CONFIG_METHODS(copy_backend, std::string)
+    DDB_OWS_CONFIG_METHODS(copy_queue_depth, unsigned int)
+    DDB_OWS_CONFIG_METHODS(copy_checkpoint_mb, unsigned int)
+    DDB_OWS_CONFIG_METHODS(delta_limit_kb, unsigned int)
 
   private:
     DB_functions_t* ddb;
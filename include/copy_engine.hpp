@@ -0,0 +1,159 @@
+#ifndef DDB_OWS_COPY_ENGINE_HPP
+#define DDB_OWS_COPY_ENGINE_HPP
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stop_token>
+
+#include "io_limiter.hpp"
+
+namespace ddb_ows {
+
+// Ways of copying file contents, fastest first. Each is tried in turn until
+// one works for the given pair of files.
+enum class copy_strategy {
+    none,
+    // Share the source's extents, e.g. on btrfs or XFS
+    reflink,
+    // Copy in the kernel, possibly offloaded to the filesystem or device
+    copy_file_range,
+    sendfile,
+    read_write,
+    // Pipelined reads and writes through io_uring
+    io_uring,
+    // Only the blocks that differ were written to the existing destination
+    delta,
+    // The destination was made a link to the source, see link_mode
+    hardlink,
+    symlink,
+};
+
+// How destinations on the same filesystem as their source are materialized
+enum class link_mode {
+    copy,
+    hardlink,
+    // Absolute symbolic links to the source
+    symlink,
+};
+
+enum class copy_backend {
+    // Try each copy_strategy in turn
+    standard,
+    // Use io_uring if available, otherwise fall back to standard
+    io_uring,
+};
+
+const char* copy_strategy_name(copy_strategy strategy);
+
+// Bounds the bytes that copies leave dirty in the page cache, shared by all
+// copies of a sync. Rather than syncing each file, copies start writeback of
+// every chunk they write with sync_file_range, and wait for their oldest
+// chunks to be written back while the budget is exceeded. The kernel thus
+// writes steadily during the sync instead of in bursts, and little is left
+// to write when the sync ends.
+struct WriteBudget {
+    explicit WriteBudget(uintmax_t _limit) : limit(_limit) {}
+
+    const uintmax_t limit;
+    // Bytes whose writeback may not have finished
+    std::atomic<uintmax_t> dirty = 0;
+};
+
+// Applies a WriteBudget to writes to one file
+class WritebackThrottle {
+  public:
+    // budget may be null, in which case writes are not throttled
+    WritebackThrottle(int _fd, WriteBudget* _budget) : fd(_fd), budget(_budget) {}
+    WritebackThrottle(const WritebackThrottle&) = delete;
+    // Writeback of the remaining chunks has been started, so we stop counting
+    // them rather than wait for them
+    ~WritebackThrottle();
+
+    // Call after writing len bytes at off
+    void wrote(off_t off, size_t len);
+
+  private:
+    int fd;
+    WriteBudget* budget;
+    std::deque<std::pair<off_t, size_t>> pending;
+    uintmax_t pending_bytes = 0;
+};
+
+struct copy_opts_t {
+    // Falls back to copying if source and destination are on different
+    // filesystems, or the filesystem doesn't support the kind of link
+    link_mode link = link_mode::copy;
+    copy_backend backend = copy_backend::standard;
+    // Bytes per copy_file_range or sendfile call
+    size_t chunk_size = 16 * 1024 * 1024;
+    // Size of the buffer for read/write copies, and of each io_uring read
+    size_t buffer_size = 1024 * 1024;
+    // Number of buffers io_uring keeps in flight per copy
+    unsigned int queue_depth = 16;
+    // Not throttled if null
+    std::shared_ptr<WriteBudget> write_budget;
+    // Every chunk is acquired from the limiter before it is copied, if set
+    std::shared_ptr<IoLimiter> limiter;
+    // Once stop is requested, copies fail with ECANCELED before their next
+    // chunk, or while waiting for the limiter
+    std::stop_token stop;
+    // Copy into a staging file next to the destination, which is renamed over
+    // it once complete, so that an interrupted copy never leaves a truncated
+    // destination behind. Destinations whose names leave no room for the
+    // staging suffix are written directly.
+    bool staged = false;
+    // Staged copies of files larger than this record their progress every
+    // checkpoint_interval bytes, and pick up from the last checkpoint when
+    // interrupted. 0 to always start over.
+    uintmax_t checkpoint_interval = 0;
+    // If the destination has the same size as the source and differs from it
+    // in at most this many bytes, only the blocks that differ are rewritten in
+    // place, e.g. after the source was retagged and its tags still fit their
+    // padding. 0 to always copy in full.
+    uintmax_t delta_limit = 0;
+};
+
+struct copy_stats_t {
+    // The strategy that copied the last byte
+    copy_strategy strategy = copy_strategy::none;
+    // Copied by this call, i.e. excluding those kept from an interrupted copy
+    uintmax_t bytes = 0;
+    // Read by this call, which includes the destination when comparing it to
+    // the source
+    uintmax_t bytes_read = 0;
+    // Offset an interrupted copy was resumed from
+    uintmax_t resumed_from = 0;
+    std::chrono::nanoseconds duration{0};
+
+    // In bytes per second
+    double throughput() const;
+};
+
+// Copies the contents and permissions of source to destination, replacing
+// destination if it exists. Unlike std::filesystem::copy_file, the fastest
+// strategy the filesystems support is used, or the io_uring backend if
+// selected. Resumable copies always use the standard backend, since io_uring
+// writes chunks out of order. See copy_opts_t for when only the differences to
+// an existing destination are written. Throws filesystem_error on failure.
+copy_stats_t copy_file_contents(
+    const std::filesystem::path& source,
+    const std::filesystem::path& destination,
+    const copy_opts_t& opts = {}
+);
+
+// Returns the destination p belongs to if p is the staging file or progress
+// record of a staged copy, or the staging name of a link, i.e. one left
+// behind by an interrupted copy when no copy is running
+std::optional<std::filesystem::path> staged_destination(const std::filesystem::path& p);
+
+}  // namespace ddb_ows
+
+#endif
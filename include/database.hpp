@@ -5,13 +5,19 @@
 #include <sqlite3.h>
 
 #include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+#include "db_opts.hpp"
+#include "fingerprint.hpp"
 
 namespace ddb_ows {
 
@@ -27,14 +33,120 @@ struct synced_file_data_t {
     std::chrono::seconds timestamp;
 };
 
+// The latest sync of every file, keyed by source path
+using sync_snapshot_t = std::unordered_map<std::string, synced_file_data_t>;
+
+struct output_path_data_t {
+    // Identifies the title format and the metadata the path was computed from
+    uint64_t fingerprint;
+    std::filesystem::path output_path;
+};
+
+// Previously computed output paths, keyed by source path
+using output_paths_t = std::unordered_map<std::string, output_path_data_t>;
+
+// The cover found for a source directory. Valid as long as neither the
+// directory nor the image have been modified since.
+struct cover_cache_entry_t {
+    std::filesystem::file_time_type dir_mtime;
+    std::filesystem::path image_filename;
+    std::filesystem::file_time_type image_mtime;
+};
+
+// Keyed by source directory
+using cover_cache_t = std::unordered_map<std::string, cover_cache_entry_t>;
+
+// A fingerprint of a source's contents. Valid as long as the source has not
+// been modified since.
+struct content_fingerprint_entry_t {
+    std::filesystem::file_time_type mtime;
+    fingerprint_method method;
+    content_fingerprint_t fingerprint;
+};
+
+// Keyed by source path
+using content_fingerprints_t = std::unordered_map<std::string, content_fingerprint_entry_t>;
+
+// One job that ran during a sync
+struct job_record_t {
+    using path = std::filesystem::path;
+    sync_id_t sync_id;
+    path source;
+    path destination;
+    // E.g. "copy" or "convert", see Job::kind()
+    std::string kind;
+    // Empty if the job didn't write anything
+    std::string strategy;
+    uintmax_t bytes_read;
+    uintmax_t bytes_written;
+    // Wall time
+    std::chrono::microseconds duration;
+    bool success;
+};
+
+// Wall time of each phase of a sync. With stream_jobs, execution starts while
+// the other phases are still running.
+struct sync_phases_t {
+    std::chrono::milliseconds save_playlists{0};
+    // Reading previous syncs, scanning the destination, and collecting and
+    // registering sources
+    std::chrono::milliseconds gather{0};
+    // Deciding what to do with each source, including stale files
+    std::chrono::milliseconds plan{0};
+    // Finding covers and queueing their jobs
+    std::chrono::milliseconds cover{0};
+    std::chrono::milliseconds execute{0};
+};
+
+// Totals of the jobs of one sync
+struct sync_summary_t {
+    sync_id_t sync_id;
+    std::chrono::seconds timestamp;
+    // Not recorded for syncs by versions before schema 6, or cancelled ones
+    std::optional<sync_phases_t> phases;
+    uintmax_t n_jobs;
+    uintmax_t n_failed;
+    uintmax_t bytes_read;
+    uintmax_t bytes_written;
+    // Sum of the wall times of the jobs, which overlap when run in parallel
+    std::chrono::microseconds job_time;
+
+    // Bytes written per second of execution, 0 if unknown
+    double throughput() const;
+};
+
+// Totals of the jobs of one kind and strategy within a sync
+struct job_summary_t {
+    std::string kind;
+    std::string strategy;
+    uintmax_t n_jobs;
+    uintmax_t n_failed;
+    uintmax_t bytes_read;
+    uintmax_t bytes_written;
+    std::chrono::microseconds job_time;
+    // Of the slowest job
+    std::chrono::microseconds max_job_time;
+};
+
 class Database {
     using path = std::filesystem::path;
 
   public:
-    Database(path root);
+    Database(path root, const db_opts_t& opts = default_opts);
     ~Database();
 
+    // Commit all pending writes
+    void flush();
+    // Commit all pending writes and make the database durable: leave the fast
+    // profile if it is in use, and truncate the write-ahead log if any.
+    void checkpoint();
+
+    // SQLite's own defaults, without batching
+    static const db_opts_t default_opts;
+
     std::optional<synced_file_data_t> find_entry(path);
+    // Equivalent to find_entry for every file, in a single query
+    std::optional<sync_snapshot_t> get_snapshot();
 
     void register_file(const path& source);
     void register_synced_file(const synced_file_data_t& data);
@@ -46,12 +158,34 @@ class Database {
 
     std::optional<std::vector<std::tuple<path, path>>> get_unreferenced_files();
 
+    std::optional<output_paths_t> get_output_paths();
+    // Returns false if nothing was stored, e.g. because the source is not
+    // registered
+    bool register_output_path(const path& source, const output_path_data_t& data);
+
+    std::optional<cover_cache_t> get_cover_cache();
+    void register_cover(const path& source_dir, const cover_cache_entry_t& entry);
+
+    std::optional<content_fingerprints_t> get_content_fingerprints();
+    // Equivalent to looking up source in get_content_fingerprints
+    std::optional<content_fingerprint_entry_t> get_content_fingerprint(const path& source);
+    void register_content_fingerprint(
+        const path& source, const content_fingerprint_entry_t& entry
+    );
+
     std::optional<sync_id_t> new_sync(
         const std::string& fn_format,
         bool cover_sync,
         const std::optional<std::string>& cover_fname,
         bool rm_unref
     );
+    void register_sync_phases(sync_id_t sync_id, const sync_phases_t& phases);
+    void register_job_stats(const job_record_t& record);
+
+    // The latest limit syncs, newest first
+    std::optional<std::vector<sync_summary_t>> get_sync_summaries(size_t limit);
+    // The jobs of sync_id by kind and strategy, those that took longest first
+    std::optional<std::vector<job_summary_t>> get_job_summaries(sync_id_t sync_id);
 
   private:
     std::mutex m;
@@ -63,6 +197,27 @@ class Database {
 
     sqlite3_stmt* _get_statement(const std::string& name);
 
+    // Writes are batched into transactions that are committed once
+    // batch_size writes are pending, or by the flusher thread after at most
+    // flush_interval. All of these must be called with m held.
+    size_t batch_size;
+    std::chrono::milliseconds flush_interval;
+    bool in_transaction = false;
+    size_t n_pending = 0;
+    std::condition_variable_any flush_cv;
+    std::jthread flusher;
+
+    void _begin_write();
+    void _end_write(sqlite3_stmt* stmt);
+    void _commit();
+
+    db_opts_t opts;
+    // Whether the fast profile is in effect
+    bool fast = false;
+    std::string journal_mode;
+    void _apply_pragmas(bool fast);
+    std::optional<std::string> _pragma(const std::string& name, const std::string& value);
+
   private:
     // Because of the mutex this class can neither be copied or moved, but we
     // need a non-default destructor for the sqlite pointer. By rule of five we
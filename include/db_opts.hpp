@@ -0,0 +1,29 @@
+#ifndef DDB_OWS_DB_OPTS_HPP
+#define DDB_OWS_DB_OPTS_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace ddb_ows {
+
+struct db_opts_t {
+    // Number of writes grouped into one transaction; 1 disables batching
+    unsigned int batch_size;
+    // Pending writes are committed at least this often
+    unsigned int flush_ms;
+    // SQLite pragmas applied when the database is opened. See
+    // https://sqlite.org/pragma.html for the meaning of the values.
+    std::string journal_mode;
+    std::string synchronous;
+    int cache_size;
+    int64_t mmap_size;
+    std::string temp_store;
+    // Run with synchronous=OFF and an in-memory journal, and only switch to
+    // the settings above at the end-of-sync checkpoint. A crash or unplugging
+    // during the sync may corrupt the database.
+    bool fast_until_checkpoint;
+};
+
+}  // namespace ddb_ows
+
+#endif
@@ -40,6 +40,9 @@ struct ddb_ows_plugin_t {
     bool (*cancel)(cancel_cb_t callback);
     std::string (*get_output_path)(DB_playItem_t* it, char* format);
     plt_uuid (*plt_get_uuid)(ddb_playlist_t* plt);
+    // Applies new limits to the running sync, if any, without changing the
+    // configuration. 0 means unlimited.
+    void (*set_io_limits)(uintmax_t bytes_per_sec, unsigned int ops_per_sec);
 };
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef DDB_OWS_DEST_INDEX_HPP
+#define DDB_OWS_DEST_INDEX_HPP
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ddb_ows {
+
+struct dest_entry_t {
+    std::filesystem::file_time_type mtime;
+    uintmax_t size;
+    dev_t dev;
+    ino_t ino;
+};
+
+// Snapshot of every file below a destination root, built by walking the tree
+// once. Looking files up here avoids one path resolution per stat on the
+// destination device, which is often slow.
+class DestinationIndex {
+    using path = std::filesystem::path;
+
+  public:
+    // Scans root, distributing its top-level directories across n_threads
+    // threads
+    DestinationIndex(const path& root, unsigned int n_threads = 1);
+
+    // Returns the entry for p, or nullopt if it doesn't exist. Paths outside
+    // of root are stat'ed directly.
+    std::optional<dest_entry_t> find(const path& p) const;
+    bool exists(const path& p) const { return find(p).has_value(); }
+    // Whether the mtime of destination is later than that of source, or
+    // destination is a hard link to source. Only destination is looked up in
+    // the index. Throws filesystem_error if source can't be stat'ed.
+    bool is_newer(const path& destination, const path& source) const;
+
+    size_t size() const { return entries.size(); }
+    // Whether the destination filesystem ignores case in file names, e.g.,
+    // FAT. Lookups fold case accordingly.
+    bool case_insensitive() const { return fold_case; }
+    // Directories that could not be read
+    const std::vector<path>& errors() const { return scan_errors; }
+    // Staging files and progress records of staged copies, which are not
+    // indexed. Those whose destination isn't synced again are left over from
+    // interrupted copies that can't be resumed.
+    const std::vector<path>& staged() const { return staged_files; }
+
+  private:
+    using entry_map = std::unordered_map<std::string, dest_entry_t>;
+    using dir_id_t = std::pair<dev_t, ino_t>;
+
+    path root;
+    bool fold_case = false;
+    entry_map entries;
+    std::vector<path> scan_errors;
+    std::vector<path> staged_files;
+
+    // Returns the index key for a path relative to root
+    std::string key(std::string relative) const;
+    // Adds every file below dirfd to out, or to staged if it belongs to a
+    // staged copy, prefixing keys with prefix. Takes ownership of dirfd.
+    // Subdirectories are added to subdirs instead of being descended into if
+    // subdirs is not null. ancestors holds the directories being scanned
+    // above dirfd, which symbolic links back into are skipped.
+    void scan(
+        int dirfd,
+        const std::string& prefix,
+        entry_map& out,
+        std::vector<path>& errors,
+        std::vector<path>& staged,
+        std::vector<dir_id_t>& ancestors,
+        std::vector<std::string>* subdirs
+    ) const;
+};
+
+}  // namespace ddb_ows
+
+#endif
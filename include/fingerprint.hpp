@@ -0,0 +1,44 @@
+#ifndef DDB_OWS_FINGERPRINT_HPP
+#define DDB_OWS_FINGERPRINT_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <stop_token>
+
+#include "io_limiter.hpp"
+
+namespace ddb_ows {
+
+// Identifies a file by its contents, so that it can be recognized after it
+// was moved or renamed
+struct content_fingerprint_t {
+    uintmax_t size;
+    uint64_t hash;
+
+    bool operator==(const content_fingerprint_t& other) const = default;
+};
+
+// Values are persisted in the database
+enum class fingerprint_method {
+    // Hash only the head and the tail of the file
+    sampled = 0,
+    // Hash the whole file
+    full = 1,
+};
+
+// Bytes hashed at either end of a file by fingerprint_method::sampled
+constexpr size_t FINGERPRINT_SAMPLE_SIZE = 64 * 1024;
+
+// Every read is acquired from limiter first if it is not null. Throws
+// filesystem_error if the file can't be read, or with ECANCELED once stop is
+// requested.
+content_fingerprint_t fingerprint_file(
+    const std::filesystem::path& p,
+    fingerprint_method method,
+    IoLimiter* limiter = nullptr,
+    std::stop_token stop = {}
+);
+
+}  // namespace ddb_ows
+
+#endif
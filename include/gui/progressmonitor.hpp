@@ -35,6 +35,9 @@ class ProgressMonitor {
     std::atomic<size_t> n_queued = 0;
     size_t n_jobs;
     std::atomic<size_t> n_finished = 0;
+    // Jobs may start finishing before queueing is complete, in which case the
+    // total number of jobs is not yet known
+    std::atomic<bool> queueing_complete = false;
     bool cancelled = false;
 
     Gtk::ProgressBar* pb;
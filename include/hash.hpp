@@ -0,0 +1,49 @@
+#ifndef DDB_OWS_HASH_HPP
+#define DDB_OWS_HASH_HPP
+
+#include <cstdint>
+#include <string_view>
+
+namespace ddb_ows {
+
+// 64-bit FNV-1a. Not cryptographic, but stable across builds and platforms,
+// so hashes can be persisted in the database.
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+constexpr uint64_t FNV_PRIME = 0x100000001b3;
+
+inline uint64_t fnv1a(std::string_view data, uint64_t hash = FNV_OFFSET_BASIS) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hashes a sequence of strings such that the boundaries between them matter,
+// i.e., ("ab", "c") and ("a", "bc") hash differently
+inline uint64_t fnv1a_field(std::string_view data, uint64_t hash) {
+    hash = fnv1a(data, hash);
+    return fnv1a(std::string_view("\0", 1), hash);
+}
+
+// Like fnv1a, but consumes 8 bytes at a time, which makes it fast enough for
+// file contents. Words are read as little-endian so that hashes are the same
+// on every platform.
+inline uint64_t hash_bytes(std::string_view data, uint64_t hash = FNV_OFFSET_BASIS) {
+    constexpr uint64_t MIX_PRIME = 0x9e3779b97f4a7c15;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 8; j++) {
+            word |= uint64_t(static_cast<unsigned char>(data[i + j])) << (8 * j);
+        }
+        hash ^= word;
+        hash *= MIX_PRIME;
+        hash ^= hash >> 29;
+    }
+    return fnv1a(data.substr(i), hash);
+}
+
+}  // namespace ddb_ows
+
+#endif
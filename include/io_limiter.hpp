@@ -0,0 +1,51 @@
+#ifndef DDB_OWS_IO_LIMITER_HPP
+#define DDB_OWS_IO_LIMITER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stop_token>
+
+namespace ddb_ows {
+
+// Token buckets for bytes and operations per second, shared by all workers of
+// a sync so that they don't saturate the disks. Each bucket holds up to one
+// second worth of tokens. Requests are granted as soon as their bucket is no
+// longer in debt, so that a large request doesn't wait for a full bucket;
+// later requests wait until the debt is repaid instead. Limits can be changed
+// while requests are waiting.
+class IoLimiter {
+  public:
+    // 0 means unlimited
+    void set_limits(uintmax_t bytes_per_sec, unsigned int ops_per_sec);
+    // Blocks until the request may proceed. Returns false without taking any
+    // tokens if stop is requested first.
+    bool acquire(uintmax_t bytes, unsigned int ops = 1, std::stop_token stop = {});
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct bucket_t {
+        double rate = 0;
+        double tokens = 0;
+
+        void refill(double seconds);
+        // Seconds until the bucket is out of debt
+        double wait() const { return rate > 0 && tokens < 0 ? -tokens / rate : 0; }
+        void take(double n);
+    };
+
+    std::mutex m;
+    std::condition_variable_any c;
+    bucket_t bytes;
+    bucket_t ops;
+    clock::time_point last = clock::now();
+
+    // Must be called with m held
+    void _refill();
+};
+
+}  // namespace ddb_ows
+
+#endif
@@ -6,13 +6,40 @@
 #include <deadbeef/converter.h>
 // clang-format on
 
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
 
+#include "copy_engine.hpp"
 #include "database.hpp"
 #include "logger.hpp"
+#include "transcode_cache.hpp"
 
 namespace ddb_ows {
 
+// Which pool of workers runs a job
+enum class job_lane {
+    // Jobs bound by CPU time, e.g. encoding
+    cpu,
+    // Jobs bound by the destination device
+    io,
+};
+constexpr size_t N_JOB_LANES = 2;
+
+// What a job did, for reporting
+struct job_stats_t {
+    // How the job wrote its output, e.g. the copy strategy
+    std::string strategy;
+    // Written
+    uintmax_t bytes = 0;
+    uintmax_t bytes_read = 0;
+    // Spent writing the output
+    std::chrono::nanoseconds duration{0};
+};
+
 class Job {
   protected:
     using path = std::filesystem::path;
@@ -25,8 +52,30 @@ class Job {
         path _destination) :
         logger(_logger), db(_db), source(_source), destination(_destination), sync_id(_sync_id) {};
     virtual bool run(bool dry = false) = 0;
+    // Cleans up after a job that will not run, e.g. because the sync was
+    // cancelled while it was queued
     virtual void abort() = 0;
+    // Asks a job to return from run() as soon as possible. Called from another
+    // thread while run() is in progress.
+    virtual void interrupt() {}
     virtual ~Job() {};
+    virtual job_lane lane() const { return job_lane::io; }
+    // Estimated relative cost of running the job, for scheduling. Only
+    // comparable between jobs of the same type.
+    virtual double cost() const { return 0; }
+    // Bytes of temporary files the job holds until it has run, e.g. a
+    // converted file waiting to be installed
+    virtual uintmax_t scratch_size() const { return 0; }
+    // Returns the job that completes this one after it ran successfully, if
+    // any. The continuation may run in another lane.
+    virtual std::unique_ptr<Job> continuation() { return nullptr; }
+    // Only meaningful once run() has returned
+    const job_stats_t& get_stats() const { return stats; }
+    // What the job does, e.g. "copy", for the sync history
+    virtual const char* kind() const = 0;
+    // Records the outcome of run() and the stats in the sync history, along
+    // with the wall time run() took
+    void register_stats(bool success, std::chrono::nanoseconds wall_time);
 
   protected:
     std::shared_ptr<Logger> logger;
@@ -34,6 +83,7 @@ class Job {
     const path source;
     const path destination;
     const sync_id_t sync_id;
+    job_stats_t stats;
     virtual void register_job() = 0;
 };
 
@@ -44,12 +94,15 @@ class CopyJob : public Job {
         DatabaseHandle db,
         sync_id_t sync_id,
         path source,
-        path destination
+        path destination,
+        const copy_opts_t& copy_opts = {}
     );
     bool run(bool dry = false) override;
+    const char* kind() const override { return "copy"; }
     void abort() override {}
 
   private:
+    const copy_opts_t copy_opts;
     void register_job() override;
 };
 
@@ -62,14 +115,19 @@ class MoveJob : public Job {
         path source,
         path old_destination,
         path destination,
-        std::optional<std::string> converter_preset
+        std::optional<std::string> converter_preset,
+        // Set if old_destination was synced from another source, which
+        // source has replaced, e.g. because it was moved in the library
+        std::optional<path> old_source = std::nullopt
     );
     bool run(bool dry = false) override;
+    const char* kind() const override { return "move"; }
     void abort() override {}
 
   private:
     path old_destination;
     std::optional<std::string> converter_preset;
+    std::optional<path> old_source;
     void register_job() override;
 };
 
@@ -83,17 +141,75 @@ class ConvertJob : public Job {
         DB_playItem_t* it,
         sync_id_t sync_id,
         path source,
-        path destination
+        path destination,
+        const copy_opts_t& copy_opts = {},
+        // Where to encode into, the system's temporary directory if empty
+        path scratch_dir = {},
+        // Encoded files are looked up in and added to the cache, if set
+        std::shared_ptr<TranscodeCache> cache = nullptr
     );
     ~ConvertJob();
     bool run(bool dry = false) override;
+    const char* kind() const override { return "convert"; }
     void abort() override;
+    void interrupt() override;
+    job_lane lane() const override { return job_lane::cpu; }
+    // Seconds of audio to encode
+    double cost() const override { return duration; }
+    // Installs the converted file at the destination
+    std::unique_ptr<Job> continuation() override;
 
   private:
     DB_functions_t* ddb;
     ddb_converter_settings_t settings;
     DB_playItem_t* it;
+    // Polled by the converter between blocks. Only accessed atomically.
     int pabort;
+    double duration;
+    const copy_opts_t copy_opts;
+    const path scratch_dir;
+    std::shared_ptr<TranscodeCache> cache;
+    // The encoder writes here, so that the destination device is only written
+    // to by the I/O lane, in large sequential writes rather than the small
+    // seeks and rewrites encoders do. Empty once handed to the continuation.
+    path scratch;
+
+    // The continuation registers the conversion once it is installed
+    void register_job() override {}
+    // Reuses the fingerprint stored for source if it wasn't modified since,
+    // and stores it otherwise. Returns nothing if source can't be read.
+    std::optional<content_fingerprint_t> source_fingerprint();
+    // Identifies the output of converting source with settings and its current
+    // tags, or nothing if source can't be read
+    std::optional<std::string> transcode_key();
+};
+
+// Moves a file that was produced in a scratch location to its destination,
+// and registers it as the sync of source
+class InstallJob : public Job {
+  public:
+    InstallJob(
+        std::shared_ptr<Logger> logger,
+        DatabaseHandle db,
+        sync_id_t sync_id,
+        path source,
+        path scratch,
+        path destination,
+        std::optional<std::string> converter_preset,
+        const copy_opts_t& copy_opts = {}
+    );
+    ~InstallJob();
+    bool run(bool dry = false) override;
+    const char* kind() const override { return "install"; }
+    void abort() override;
+    uintmax_t scratch_size() const override { return scratch_bytes; }
+
+  private:
+    path scratch;
+    // Size of scratch when the job was created
+    uintmax_t scratch_bytes;
+    std::optional<std::string> converter_preset;
+    const copy_opts_t copy_opts;
 
     void register_job() override;
 };
@@ -108,12 +224,16 @@ class DeleteJob : public Job {
         path destination
     );
     bool run(bool dry = false) override;
+    const char* kind() const override { return "delete"; }
     void abort() override {};
 
   private:
     void register_job() override;
 };
 
+// Removes p and each of its parents as long as they are empty directories
+void clean_parents(std::filesystem::path p);
+
 }  // namespace ddb_ows
 
 #endif
@@ -1,25 +1,112 @@
 #ifndef DDB_OWS_JOBSQUEUE_HPP
 #define DDB_OWS_JOBSQUEUE_HPP
 
+#include <array>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <unordered_set>
+#include <utility>
 
 #include "job.hpp"
 
 namespace ddb_ows {
 
+// The order in which the jobs of a lane are run
+enum class job_order {
+    // In the order they were pushed
+    fifo,
+    // Most expensive first according to Job::cost(), so that long jobs don't
+    // end up running alone at the end. Jobs of equal cost are run in FIFO
+    // order.
+    longest_first,
+};
+
+// Holds jobs for each lane separately, so that each pool of workers only takes
+// jobs of its own lane
 class JobsQueue {
   private:
-    std::deque<std::unique_ptr<Job>> q;
+    struct queued_job {
+        double cost;
+        // Position in the order of pushes, to break ties
+        size_t seq;
+        std::chrono::steady_clock::time_point pushed;
+        std::unique_ptr<Job> job;
+    };
+    // Orders queued jobs for a max-heap: the most expensive on top, and the
+    // one pushed first among equally expensive ones
+    static bool heap_less(const queued_job& a, const queued_job& b);
+    // Ordered by job_order: either a FIFO queue or a max-heap
+    std::array<std::deque<queued_job>, N_JOB_LANES> q;
+    std::array<job_order, N_JOB_LANES> order{};
+    size_t next_seq = 0;
     std::condition_variable c;
     std::mutex m;
     bool isOpen;
+    bool cancelled = false;
+    // Number of jobs pushed since the queue was last opened
+    size_t n_pushed = 0;
+    // Jobs popped but not yet done, per lane. These may still push
+    // continuations.
+    std::array<size_t, N_JOB_LANES> n_running{};
+    // Maximum of n_running per lane, see set_limit
+    std::array<size_t, N_JOB_LANES> limit;
+    // Output of the jobs that have run, per lane
+    std::array<uintmax_t, N_JOB_LANES> n_done{};
+    std::array<uintmax_t, N_JOB_LANES> bytes_done{};
+    // Jobs popped per lane, and the time they spent queued in total
+    std::array<uintmax_t, N_JOB_LANES> n_started{};
+    std::array<double, N_JOB_LANES> wait_seconds{};
+    // Jobs inside run(), which cancel() interrupts
+    std::unordered_set<Job*> running;
+    // Continuations holding scratch files that have not run yet, and their
+    // total size. The CPU lane is paused while either exceeds its limit, so
+    // that encoders can't fill the scratch directory faster than the I/O
+    // lane empties it.
+    size_t n_scratch = 0;
+    uintmax_t scratch_bytes = 0;
+    size_t max_scratch_files = SIZE_MAX;
+    uintmax_t max_scratch_bytes = UINTMAX_MAX;
+
+    // Must be called with m held
+    void _push(std::unique_ptr<Job> job);
+    // Must be called with m held, and lane must not be empty
+    std::unique_ptr<Job> _pop(size_t lane);
+    // Whether no more jobs can appear. Must be called with m held.
+    bool _drained();
+    // Must be called with m held, once a job returned by pop() will not
+    // run anymore
+    void _release_scratch(const Job& job);
+    // Whether jobs of lane may start. Must be called with m held.
+    bool _may_start(size_t lane);
 
   public:
-    JobsQueue(void) : q(), c(), m() { isOpen = true; }
+    struct lane_stats_t {
+        // Jobs that have run, and the bytes they wrote according to
+        // Job::get_stats()
+        uintmax_t n_done;
+        uintmax_t bytes_done;
+        // Jobs that have left the queue, and the seconds they waited in it
+        uintmax_t n_started;
+        double wait_seconds;
+    };
+
+    JobsQueue(void) : q(), c(), m() {
+        isOpen = true;
+        limit.fill(SIZE_MAX);
+    }
     void push_back(std::unique_ptr<Job> job);
+    // Should only be changed while lane is empty
+    void set_order(job_lane lane, job_order order);
+    // Lets at most n jobs of lane run at once; pop(lane) blocks while as many
+    // are running. Unlimited by default.
+    void set_limit(job_lane lane, size_t n);
+    // Pauses the CPU lane while more than max_files continuations holding
+    // scratch files, or more than max_bytes of them, wait to run
+    void set_scratch_limits(size_t max_files, uintmax_t max_bytes);
 
     template <typename T, typename... Args>
     void emplace_back(Args&&... args) {
@@ -27,15 +114,37 @@ class JobsQueue {
         if (!isOpen) {
             return;
         }
-        q.emplace_back(std::make_unique<T>(std::forward<Args>(args)...));
-        c.notify_one();
+        _push(std::make_unique<T>(std::forward<Args>(args)...));
+        n_pushed++;
     }
-    std::unique_ptr<Job> pop();
+    // Pushes the continuation of a job that has finished. Unlike push_back,
+    // this works after close() so that running jobs can finish their work,
+    // and the job is not counted in total() as it completes its predecessor.
+    void push_continuation(std::unique_ptr<Job> job);
+    // Blocks until there is a job in lane, and returns it. Returns an empty
+    // pointer once the queue is closed and drained.
+    std::unique_ptr<Job> pop(job_lane lane);
+    // Runs a job returned by pop() such that cancel() can interrupt it, and
+    // records it in the sync history unless dry. Returns false without running
+    // the job if the queue was cancelled.
+    bool run(Job& job, bool dry);
+    // Must be called when a job returned by pop(lane) is done, after pushing
+    // its continuation if any
+    void done(job_lane lane);
+    // Blocks until no more jobs can appear, or for at most timeout. Returns
+    // whether no more jobs can appear.
+    bool wait_drained(std::chrono::milliseconds timeout);
     void close();
+    // Starts a sync. Called once per sync, by whoever runs it. Opening a
+    // queue that is already open changes nothing.
     void open();
+    // Drops the queued jobs and interrupts the running ones
     void cancel();
     bool empty();
     size_t size();
+    size_t total();
+    // Totals for the jobs of lane since the queue was created
+    lane_stats_t lane_stats(job_lane lane);
 };
 
 }  // namespace ddb_ows
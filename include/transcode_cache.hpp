@@ -0,0 +1,54 @@
+#ifndef DDB_OWS_TRANSCODE_CACHE_HPP
+#define DDB_OWS_TRANSCODE_CACHE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "copy_engine.hpp"
+
+namespace ddb_ows {
+
+// Local directory of encoded files, keyed by everything that determines their
+// contents, so that a source that was converted with the same settings before,
+// e.g. for another destination, is copied from here instead of being encoded
+// again. The least recently used files are evicted once the cache outgrows its
+// size limit. Safe to use from several threads.
+class TranscodeCache {
+    using path = std::filesystem::path;
+
+  public:
+    TranscodeCache(const path& _dir, uintmax_t _max_size) : dir(_dir), max_size(_max_size) {}
+
+    // Copies the file cached under key to out. Returns false if there is
+    // none, or it could not be copied.
+    bool fetch(const std::string& key, const path& out, const copy_opts_t& opts);
+    // Adds a copy of file under key. Throws filesystem_error on failure.
+    void store(const std::string& key, const path& file, const copy_opts_t& opts);
+
+  private:
+    struct entry_t {
+        std::filesystem::file_time_type last_used;
+        uintmax_t size;
+    };
+
+    const path dir;
+    const uintmax_t max_size;
+    // Guards entries and total
+    std::mutex m;
+    // Keyed by key. Loaded from dir on first use, and kept up to date after,
+    // so that evicting doesn't need to list dir.
+    std::optional<std::unordered_map<std::string, entry_t>> entries;
+    uintmax_t total = 0;
+
+    // All of these must be called with m held
+    void _load();
+    void _evict();
+};
+
+}  // namespace ddb_ows
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef DDB_OWS_URING_COPY_HPP
+#define DDB_OWS_URING_COPY_HPP
+
+#include <linux/io_uring.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "copy_engine.hpp"
+
+namespace ddb_ows {
+
+// Copies files through an io_uring, keeping many chunks of a file in flight
+// at once so that the destination device sees a deep queue. Uses the raw
+// system calls rather than liburing.
+class UringCopier {
+    using path = std::filesystem::path;
+
+  public:
+    // Returns this thread's copier, creating it on first use, or nullptr if
+    // io_uring or an operation we need is unavailable, e.g. on kernels older
+    // than 5.6 or when disabled by seccomp.
+    static UringCopier* for_thread(unsigned int queue_depth);
+
+    ~UringCopier();
+    UringCopier(const UringCopier&) = delete;
+
+    // Same contract as copy_file_contents
+    copy_stats_t copy(const path& source, const path& destination, const copy_opts_t& opts);
+
+  private:
+    struct slot_t {
+        std::unique_ptr<char, decltype(&std::free)> buf;
+        off_t off = 0;
+        size_t len = 0;
+        // Bytes of this chunk already written
+        size_t pos = 0;
+        // Bytes read into buf, and how many of them have been written
+        size_t n_read = 0;
+        size_t n_written = 0;
+        bool busy = false;
+    };
+
+    int ring_fd = -1;
+    unsigned int depth;
+    void* sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    // Tail including entries that have been prepared but not yet published to
+    // the kernel
+    unsigned sq_local_tail;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    std::vector<slot_t> slots;
+    size_t slot_size = 0;
+    // Set once io_uring_enter failed with operations outstanding, whose
+    // completions would be mistaken for those of later operations. for_thread
+    // replaces the copier then.
+    bool broken = false;
+
+    UringCopier(unsigned int queue_depth);
+    bool setup();
+    bool supports_ops();
+
+    // Returns a zeroed entry to prepare, which is submitted by the next enter()
+    io_uring_sqe* get_sqe();
+    // Submits prepared entries and waits for at least min_complete
+    // completions. Returns 0 or -errno.
+    int enter(unsigned int min_complete);
+    struct completion_t {
+        uint64_t user_data;
+        int res;
+    };
+    std::optional<completion_t> pop_cqe();
+    // Submits operations and waits for all of their results, in order
+    std::vector<int> run(const std::vector<io_uring_sqe>& ops);
+
+    void prep_read(unsigned int slot, int fd);
+    void prep_write(unsigned int slot, int fd);
+};
+
+}  // namespace ddb_ows
+
+#endif
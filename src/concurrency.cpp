@@ -0,0 +1,108 @@
+#include "concurrency.hpp"
+
+#include <algorithm>
+
+namespace ddb_ows {
+
+namespace {
+
+// Changes in throughput smaller than this fraction are taken as noise
+constexpr double THROUGHPUT_TOLERANCE = 0.05;
+// Jobs that waited in the queue for less than this fraction of the time a job
+// runs on average were hardly held back by the limit
+constexpr double MIN_WAIT_FRACTION = 0.1;
+
+}  // namespace
+
+ConcurrencyController::ConcurrencyController(
+    std::shared_ptr<JobsQueue> _jobs, const std::array<lane_bounds_t, N_JOB_LANES>& bounds
+) :
+    jobs(_jobs) {
+    const auto now = clock::now();
+    for (size_t i = 0; i < N_JOB_LANES; i++) {
+        auto& state = lanes[i];
+        state.bounds = bounds[i];
+        state.limit = std::clamp(bounds[i].initial, bounds[i].min, bounds[i].max);
+        state.min_limit = state.limit;
+        state.max_limit = state.limit;
+        state.since = now;
+        state.start = now;
+        state.last_adjusted = now;
+        state.stats_since = jobs->lane_stats(job_lane(i));
+        jobs->set_limit(job_lane(i), state.limit);
+    }
+}
+
+void ConcurrencyController::adjust() {
+    for (size_t i = 0; i < N_JOB_LANES; i++) {
+        adjust(job_lane(i), lanes[i]);
+    }
+}
+
+void ConcurrencyController::adjust(job_lane lane, lane_state_t& state) {
+    using namespace std::chrono;
+    const auto now = clock::now();
+    state.limit_seconds += state.limit * duration<double>(now - state.last_adjusted).count();
+    state.last_adjusted = now;
+
+    const auto stats = jobs->lane_stats(lane);
+    const auto n_jobs = stats.n_done - state.stats_since.n_done;
+    // Each running job should have completed once, or the window mostly
+    // measures which jobs happened to be running
+    if (n_jobs < state.limit) {
+        return;
+    }
+    const double seconds = std::max(duration<double>(now - state.since).count(), 1e-3);
+    const double throughput = (stats.bytes_done - state.stats_since.bytes_done) / seconds;
+    const auto n_started = stats.n_started - state.stats_since.n_started;
+    const double mean_wait =
+        n_started > 0 ? (stats.wait_seconds - state.stats_since.wait_seconds) / n_started : 0;
+    // With limit jobs running all along, each took this long
+    const double mean_run = seconds * state.limit / n_jobs;
+    state.since = now;
+    state.stats_since = stats;
+    if (mean_wait < mean_run * MIN_WAIT_FRACTION) {
+        // Jobs hardly waited for a worker, so a higher limit would not have
+        // run more jobs, and the throughput says nothing about the limit
+        state.last_throughput = 0;
+        return;
+    }
+
+    if (state.last_throughput > 0) {
+        const bool dropped = throughput < state.last_throughput * (1 - THROUGHPUT_TOLERANCE);
+        const bool improved = throughput > state.last_throughput * (1 + THROUGHPUT_TOLERANCE);
+        // Go back if the last step hurt, or added a job without helping. Keep
+        // removing jobs as long as that costs nothing, which frees resources
+        // for the other lane.
+        if (dropped || (state.direction > 0 && !improved)) {
+            state.direction = -state.direction;
+        }
+    }
+    state.last_throughput = throughput;
+    const int next = std::clamp<int>(
+        int(state.limit) + state.direction, state.bounds.min, state.bounds.max
+    );
+    if (unsigned(next) == state.limit) {
+        // At a bound: try the other way next time
+        state.direction = -state.direction;
+        return;
+    }
+    state.limit = next;
+    state.min_limit = std::min(state.min_limit, state.limit);
+    state.max_limit = std::max(state.max_limit, state.limit);
+    jobs->set_limit(lane, state.limit);
+}
+
+ConcurrencyController::lane_summary_t ConcurrencyController::summary(job_lane lane) const {
+    using namespace std::chrono;
+    const auto& state = lanes[static_cast<size_t>(lane)];
+    const double seconds = duration<double>(state.last_adjusted - state.start).count();
+    return {
+        .min = state.min_limit,
+        .max = state.max_limit,
+        .last = state.limit,
+        .mean = seconds > 0 ? state.limit_seconds / seconds : state.limit,
+    };
+}
+
+}  // namespace ddb_ows
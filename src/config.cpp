@@ -30,6 +30,18 @@ void from_json(const json& j, plt_uuid& uuid) {
 
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(sync_pls_t, dbpl, m3u8);
 
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(
+    db_opts_t,
+    batch_size,
+    flush_ms,
+    journal_mode,
+    synchronous,
+    cache_size,
+    mmap_size,
+    temp_store,
+    fast_until_checkpoint
+);
+
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(
     ddb_ows_config,
     root,
@@ -38,12 +50,37 @@ NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(
     cover_sync,
     cover_fname,
     cover_timeout_ms,
+    cover_max_inflight,
     sync_pls,
     rm_unref,
+    rename_detection,
     conv_fts,
     conv_preset,
     conv_ext,
-    conv_wts
+    conv_wts,
+    conv_order,
+    scratch_dir,
+    scratch_max_files,
+    scratch_max_mb,
+    transcode_cache_dir,
+    transcode_cache_mb,
+    io_wts,
+    adaptive_wts,
+    worker_nice,
+    worker_io_class,
+    io_limit_mbps,
+    io_limit_iops,
+    plan_wts,
+    scan_wts,
+    stream_jobs,
+    db_opts,
+    durability,
+    dirty_budget_mb,
+    link_mode,
+    copy_backend,
+    copy_queue_depth,
+    copy_checkpoint_mb,
+    delta_limit_kb
 )
 
 Configuration::Configuration(DB_functions_t* api) : ddb(api) {
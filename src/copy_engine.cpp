@@ -0,0 +1,706 @@
+#include "copy_engine.hpp"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "uring_copy.hpp"
+
+namespace ddb_ows {
+
+namespace {
+
+using std::filesystem::filesystem_error;
+using std::filesystem::path;
+
+constexpr size_t BUFFER_ALIGNMENT = 4096;
+// Granularity at which delta updates compare and write
+constexpr size_t DELTA_BLOCK_SIZE = 4096;
+constexpr int PROGRESS_VERSION = 1;
+
+class fd_t {
+  public:
+    explicit fd_t(int _fd) : fd(_fd) {}
+    fd_t(const fd_t&) = delete;
+    ~fd_t() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    operator int() const { return fd; }
+    // Closes the file, reporting errors that close() may surface for writes
+    int close() {
+        int status = ::close(fd);
+        fd = -1;
+        return status;
+    }
+
+  private:
+    int fd;
+};
+
+// Called before each chunk. Returns false with errno set to ECANCELED if the
+// copy was cancelled, also while waiting for the limiter.
+bool limit(const copy_opts_t& opts, uintmax_t bytes, unsigned int ops = 1) {
+    if (opts.stop.stop_requested() ||
+        (opts.limiter && !opts.limiter->acquire(bytes, ops, opts.stop))) {
+        errno = ECANCELED;
+        return false;
+    }
+    return true;
+}
+
+// Whether a copy that failed with e may succeed when retried later, e.g. after
+// the device is plugged back in
+bool is_interruption(const std::error_code& e) {
+    if (e.category() != std::generic_category()) {
+        return false;
+    }
+    switch (e.value()) {
+        case EINTR:
+        case EIO:
+        case ENODEV:
+        case ENXIO:
+        case ENOTCONN:
+        case ESHUTDOWN:
+        case ETIMEDOUT:
+        case ECANCELED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+[[noreturn]] void throw_errno(const char* what, const path& source, const path& destination) {
+    throw filesystem_error(
+        what, source, destination, std::error_code(errno, std::generic_category())
+    );
+}
+
+// Each strategy copies from offset done onwards and advances it. Returns false
+// if it stopped before size, either because it is not supported for these
+// files or because of an error. The next strategy then picks up from done, and
+// the last one reports the error if there really is one.
+
+bool try_reflink(int in, int out, off_t& done, off_t size) {
+    if (done != 0 || ioctl(out, FICLONE, in) != 0) {
+        return false;
+    }
+    done = size;
+    return true;
+}
+
+bool try_copy_file_range(
+    int in, int out, off_t& done, off_t size, const copy_opts_t& opts, WritebackThrottle& wb
+) {
+    while (done < size) {
+        loff_t off_in = done;
+        loff_t off_out = done;
+        const size_t len = std::min<off_t>(opts.chunk_size, size - done);
+        if (!limit(opts, len)) {
+            return false;
+        }
+        const ssize_t n = copy_file_range(in, &off_in, out, &off_out, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            // Some filesystems report 0 instead of an error, e.g. procfs
+            return false;
+        }
+        wb.wrote(done, n);
+        done += n;
+    }
+    return true;
+}
+
+bool try_sendfile(
+    int in, int out, off_t& done, off_t size, const copy_opts_t& opts, WritebackThrottle& wb
+) {
+    // sendfile writes at the file offset rather than taking one
+    if (lseek(out, done, SEEK_SET) < 0) {
+        return false;
+    }
+    while (done < size) {
+        off_t off_in = done;
+        const size_t len = std::min<off_t>(opts.chunk_size, size - done);
+        if (!limit(opts, len)) {
+            return false;
+        }
+        const ssize_t n = sendfile(out, in, &off_in, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        wb.wrote(done, n);
+        done += n;
+    }
+    return true;
+}
+
+// Copies up to end, or until EOF if end is negative. Always works unless the
+// copy itself fails; returns false with errno set in that case.
+bool read_write(
+    int in, int out, off_t& done, off_t end, const copy_opts_t& opts, WritebackThrottle& wb
+) {
+    const size_t buf_size =
+        (opts.buffer_size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    std::unique_ptr<char, decltype(&std::free)> buf(
+        static_cast<char*>(std::aligned_alloc(BUFFER_ALIGNMENT, buf_size)), &std::free
+    );
+    if (buf == nullptr) {
+        errno = ENOMEM;
+        return false;
+    }
+    while (end < 0 || done < end) {
+        const size_t len = end < 0 ? buf_size : std::min<off_t>(buf_size, end - done);
+        if (!limit(opts, len)) {
+            return false;
+        }
+        const ssize_t n_read = pread(in, buf.get(), len, done);
+        if (n_read < 0 && errno == EINTR) {
+            continue;
+        } else if (n_read < 0) {
+            return false;
+        } else if (n_read == 0) {
+            return true;
+        }
+        ssize_t written = 0;
+        while (written < n_read) {
+            const ssize_t n = pwrite(out, buf.get() + written, n_read - written, done + written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                return false;
+            }
+            written += n;
+        }
+        wb.wrote(done, n_read);
+        done += n_read;
+    }
+    return true;
+}
+
+// Copies from done up to end, starting with strategy and falling back to the
+// slower ones. The last one continues until EOF if to_eof is set, rather than
+// stopping at the size we stat'ed, like cp does. On success, strategy is left
+// at the one that finished, so that the next range can start there.
+bool copy_range(
+    int in,
+    int out,
+    off_t& done,
+    off_t end,
+    bool to_eof,
+    copy_strategy& strategy,
+    const copy_opts_t& opts,
+    WritebackThrottle& wb
+) {
+    if (strategy <= copy_strategy::copy_file_range) {
+        if (try_copy_file_range(in, out, done, end, opts, wb)) {
+            strategy = copy_strategy::copy_file_range;
+            return true;
+        }
+        strategy = copy_strategy::sendfile;
+    }
+    if (strategy == copy_strategy::sendfile) {
+        if (try_sendfile(in, out, done, end, opts, wb)) {
+            return true;
+        }
+        strategy = copy_strategy::read_write;
+    }
+    return read_write(in, out, done, to_eof ? -1 : end, opts, wb);
+}
+
+struct progress_t {
+    // Identify the source the checkpoint was made for
+    off_t size;
+    int64_t mtime_ns;
+    // Bytes at the start of the staging file that are complete
+    off_t copied;
+};
+
+int64_t mtime_ns(const struct stat& st) {
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+std::optional<progress_t> read_progress(const path& record) {
+    std::ifstream f(record);
+    int version;
+    progress_t progress;
+    if (!(f >> version >> progress.size >> progress.mtime_ns >> progress.copied) ||
+        version != PROGRESS_VERSION) {
+        return std::nullopt;
+    }
+    return progress;
+}
+
+// Records that the first copied bytes of out are complete. They are written
+// back first, so that a record never claims data that a crash could lose.
+void checkpoint(int out, const struct stat& st, off_t copied, const path& record) {
+    if (fdatasync(out) != 0) {
+        return;
+    }
+    const std::string line = std::to_string(PROGRESS_VERSION) + ' ' + std::to_string(st.st_size) +
+                             ' ' + std::to_string(mtime_ns(st)) + ' ' + std::to_string(copied) +
+                             '\n';
+    fd_t f(open(record.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (f < 0) {
+        return;
+    }
+    // Sync the record as well, so that the progress survives a crash or the
+    // device being unplugged. A record that is lost or cut short merely
+    // restarts the copy.
+    if (write(f, line.data(), line.size()) == ssize_t(line.size())) {
+        fdatasync(f);
+    }
+}
+
+bool pread_full(int fd, char* buf, size_t len, off_t off) {
+    while (len > 0) {
+        const ssize_t n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+bool range_matches(int in, int out, off_t off, size_t len) {
+    std::vector<char> a(len);
+    std::vector<char> b(len);
+    return pread_full(in, a.data(), len, off) && pread_full(out, b.data(), len, off) && a == b;
+}
+
+// Returns the offset to resume copying st's file at, which is 0 unless record
+// describes a checkpoint of the same source whose data is intact in out. Only
+// the first and last window bytes are compared, which catches checkpoints from
+// other sources and data that didn't reach the disk.
+off_t resume_offset(int in, int out, const struct stat& st, const path& record, size_t window) {
+    const auto progress = read_progress(record);
+    if (!progress || progress->size != st.st_size || progress->mtime_ns != mtime_ns(st) ||
+        progress->copied <= 0 || progress->copied > st.st_size) {
+        return 0;
+    }
+    struct stat out_st;
+    if (fstat(out, &out_st) != 0 || out_st.st_size < progress->copied) {
+        return 0;
+    }
+    window = std::min<off_t>(window, progress->copied);
+    if (!range_matches(in, out, 0, window) ||
+        !range_matches(in, out, progress->copied - window, window)) {
+        return 0;
+    }
+    return progress->copied;
+}
+
+// Rewrites the blocks of destination that differ from source. Returns nullopt
+// without writing anything if destination doesn't exist, has another size,
+// differs in more than opts.delta_limit bytes, or may share its contents with
+// another file, which we must not write through to.
+std::optional<copy_stats_t> update_in_place(
+    const path& source, const path& destination, const copy_opts_t& opts
+) {
+    const auto start = std::chrono::steady_clock::now();
+
+    fd_t out(open(destination.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC));
+    if (out < 0) {
+        return std::nullopt;
+    }
+    fd_t in(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in < 0) {
+        throw_errno("Could not open source", source, destination);
+    }
+    struct stat st;
+    struct stat out_st;
+    if (fstat(in, &st) != 0 || fstat(out, &out_st) != 0) {
+        throw_errno("Could not stat", source, destination);
+    }
+    if (!S_ISREG(st.st_mode) || !S_ISREG(out_st.st_mode) || out_st.st_nlink > 1 ||
+        st.st_size != out_st.st_size) {
+        return std::nullopt;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(out, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Compare everything before writing anything, so that we can still fall
+    // back to a full copy. What differs is small enough to keep in memory.
+    const size_t buf_size =
+        (opts.buffer_size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE * DELTA_BLOCK_SIZE;
+    std::vector<char> a(buf_size);
+    std::vector<char> b(buf_size);
+    std::vector<std::pair<off_t, std::string>> changes;
+    uintmax_t changed = 0;
+    for (off_t off = 0; off < st.st_size; off += buf_size) {
+        const size_t len = std::min<off_t>(buf_size, st.st_size - off);
+        if (!limit(opts, 2 * len, 2) || !pread_full(in, a.data(), len, off) ||
+            !pread_full(out, b.data(), len, off)) {
+            return std::nullopt;
+        }
+        for (size_t block = 0; block < len; block += DELTA_BLOCK_SIZE) {
+            const size_t block_len = std::min(DELTA_BLOCK_SIZE, len - block);
+            if (std::equal(a.data() + block, a.data() + block + block_len, b.data() + block)) {
+                continue;
+            }
+            const off_t block_off = off + block;
+            changed += block_len;
+            if (changed > opts.delta_limit) {
+                return std::nullopt;
+            }
+            // Coalesce adjacent blocks into one write
+            if (!changes.empty() &&
+                changes.back().first + off_t(changes.back().second.size()) == block_off) {
+                changes.back().second.append(a.data() + block, block_len);
+            } else {
+                changes.emplace_back(block_off, std::string(a.data() + block, block_len));
+            }
+        }
+    }
+
+    copy_stats_t stats{.strategy = copy_strategy::delta};
+    if (!changes.empty()) {
+        // Until all blocks are written, the destination must not look newer
+        // than the source, or an interrupted update would never be redone
+        const struct timespec stale[2] = {{.tv_sec = 0, .tv_nsec = UTIME_OMIT}, {}};
+        if (futimens(out, stale) != 0) {
+            throw_errno("Could not reset modification time of destination", source, destination);
+        }
+        for (const auto& [off, data] : changes) {
+            size_t written = 0;
+            while (written < data.size()) {
+                const ssize_t n =
+                    pwrite(out, data.data() + written, data.size() - written, off + written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n < 0) {
+                    throw_errno("Could not update destination", source, destination);
+                }
+                written += n;
+            }
+        }
+    }
+    // Also marks the destination as up to date if nothing differed
+    if (futimens(out, nullptr) != 0) {
+        throw_errno("Could not set modification time of destination", source, destination);
+    }
+    if (fchmod(out, st.st_mode & 07777) != 0) {
+        throw_errno("Could not set permissions of destination", source, destination);
+    }
+    if (out.close() != 0) {
+        throw_errno("Could not close destination", source, destination);
+    }
+    stats.bytes = changed;
+    stats.bytes_read = 2 * uintmax_t(st.st_size);
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+constexpr std::string_view STAGING_SUFFIX = ".ddb_ows-part";
+constexpr std::string_view RECORD_SUFFIX = ".ddb_ows-progress";
+// Links are staged under their own name, since a resumable copy of the same
+// destination may have left a partial copy under STAGING_SUFFIX
+constexpr std::string_view LINK_SUFFIX = ".ddb_ows-link";
+
+// Longest file name we stage under, in bytes. Most filesystems allow 255
+// bytes, and FAT and exFAT 255 UTF-16 code units, which a name never has more
+// of than UTF-8 bytes.
+constexpr size_t MAX_NAME_LENGTH = 255;
+
+// Staging files are hidden, so that players don't pick up partial files.
+// Returns nullopt if the name would be too long for the filesystem.
+std::optional<path> staging_path(const path& destination, std::string_view suffix) {
+    std::string name = "." + destination.filename().string() + std::string(suffix);
+    if (name.size() > MAX_NAME_LENGTH) {
+        return std::nullopt;
+    }
+    return destination.parent_path() / name;
+}
+
+// Makes destination a link to source. The link is created under a staging
+// name and renamed over destination, which replaces an existing destination
+// atomically. Returns nullopt if source and destination are on different
+// filesystems, the filesystem doesn't support the kind of link, or the
+// staging name would be too long.
+std::optional<copy_stats_t> link_file(const path& source, const path& destination, link_mode mode) {
+    const auto start = std::chrono::steady_clock::now();
+    copy_stats_t stats{
+        .strategy = mode == link_mode::hardlink ? copy_strategy::hardlink : copy_strategy::symlink
+    };
+
+    struct stat st;
+    struct stat dir_st;
+    if (stat(source.c_str(), &st) != 0) {
+        throw_errno("Could not stat source", source, destination);
+    }
+    if (stat(destination.parent_path().c_str(), &dir_st) != 0) {
+        throw_errno("Could not stat destination directory", source, destination);
+    }
+    if (st.st_dev != dir_st.st_dev) {
+        return std::nullopt;
+    }
+    struct stat dest_st;
+    if (mode == link_mode::hardlink && stat(destination.c_str(), &dest_st) == 0 &&
+        dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino) {
+        // Already linked. Renaming a link over another link to the same file
+        // would do nothing and leave the staging name behind.
+        return stats;
+    }
+
+    const auto staging_name = staging_path(destination, LINK_SUFFIX);
+    if (!staging_name) {
+        return std::nullopt;
+    }
+    const path& staging = *staging_name;
+    unlink(staging.c_str());
+    const int status = mode == link_mode::hardlink ? link(source.c_str(), staging.c_str())
+                                                   : symlink(source.c_str(), staging.c_str());
+    if (status != 0) {
+        if (errno == EPERM || errno == EXDEV || errno == EMLINK || errno == EOPNOTSUPP) {
+            return std::nullopt;
+        }
+        throw_errno("Could not link", source, destination);
+    }
+    if (rename(staging.c_str(), destination.c_str()) != 0) {
+        const int e = errno;
+        unlink(staging.c_str());
+        errno = e;
+        throw_errno("Could not move link into place", staging, destination);
+    }
+    // A partial copy kept for resuming is of no use anymore
+    for (const auto suffix : {STAGING_SUFFIX, RECORD_SUFFIX}) {
+        if (const auto leftover = staging_path(destination, suffix)) {
+            unlink(leftover->c_str());
+        }
+    }
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+// Copies source to destination directly. If record is given, progress is
+// checkpointed to it, and the copy a previous record describes is resumed.
+copy_stats_t copy_to(
+    const path& source, const path& destination, const copy_opts_t& opts, const path* record
+) {
+    if (opts.backend == copy_backend::io_uring && record == nullptr) {
+        if (auto copier = UringCopier::for_thread(opts.queue_depth)) {
+            return copier->copy(source, destination, opts);
+        }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    fd_t in(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in < 0) {
+        throw_errno("Could not open source", source, destination);
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        throw_errno("Could not stat source", source, destination);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        throw_errno("Source is not a regular file", source, destination);
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const mode_t mode = st.st_mode & 07777;
+    // Resuming needs to read back what we wrote
+    const int flags = record != nullptr ? O_RDWR : O_WRONLY | O_TRUNC;
+    fd_t out(open(destination.c_str(), flags | O_CREAT | O_CLOEXEC, mode));
+    if (out < 0) {
+        throw_errno("Could not open destination", source, destination);
+    }
+    // The mode passed to open() only applies to newly created files
+    if (fchmod(out, mode) != 0) {
+        throw_errno("Could not set permissions of destination", source, destination);
+    }
+
+    copy_stats_t stats;
+    off_t done = 0;
+    const off_t size = st.st_size;
+    if (record != nullptr) {
+        done = resume_offset(in, out, st, *record, opts.buffer_size);
+        // Start over, and don't let a reflink keep stale data past its end
+        if (done == 0 && ftruncate(out, 0) != 0) {
+            throw_errno("Could not truncate destination", source, destination);
+        }
+        stats.resumed_from = done;
+    }
+    WritebackThrottle wb(out, opts.write_budget.get());
+    copy_strategy strategy = copy_strategy::copy_file_range;
+    if (try_reflink(in, out, done, size)) {
+        strategy = copy_strategy::reflink;
+    } else if (record == nullptr) {
+        if (!copy_range(in, out, done, size, true, strategy, opts, wb)) {
+            throw_errno("Could not copy", source, destination);
+        }
+    } else {
+        while (true) {
+            const off_t end = std::min<off_t>(size, done + opts.checkpoint_interval);
+            if (!copy_range(in, out, done, end, end == size, strategy, opts, wb)) {
+                throw_errno("Could not copy", source, destination);
+            }
+            // Stopping short of end means that the source shrank
+            if (end == size || done < end) {
+                break;
+            }
+            checkpoint(out, st, done, *record);
+        }
+    }
+    stats.strategy = strategy;
+    if (ftruncate(out, done) != 0) {
+        throw_errno("Could not truncate destination", source, destination);
+    }
+    if (out.close() != 0) {
+        throw_errno("Could not close destination", source, destination);
+    }
+
+    stats.bytes = done - stats.resumed_from;
+    stats.bytes_read = stats.bytes;
+    stats.duration = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+}  // namespace
+
+WritebackThrottle::~WritebackThrottle() {
+    if (budget != nullptr) {
+        budget->dirty -= pending_bytes;
+    }
+}
+
+void WritebackThrottle::wrote(off_t off, size_t len) {
+    if (budget == nullptr || len == 0) {
+        return;
+    }
+    sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+    pending.emplace_back(off, len);
+    pending_bytes += len;
+    budget->dirty += len;
+    while (budget->dirty > budget->limit && !pending.empty()) {
+        const auto [oldest_off, oldest_len] = pending.front();
+        pending.pop_front();
+        sync_file_range(
+            fd,
+            oldest_off,
+            oldest_len,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER
+        );
+        pending_bytes -= oldest_len;
+        budget->dirty -= oldest_len;
+    }
+}
+
+const char* copy_strategy_name(copy_strategy strategy) {
+    switch (strategy) {
+        case copy_strategy::none:
+            return "none";
+        case copy_strategy::reflink:
+            return "reflink";
+        case copy_strategy::copy_file_range:
+            return "copy_file_range";
+        case copy_strategy::sendfile:
+            return "sendfile";
+        case copy_strategy::read_write:
+            return "read/write";
+        case copy_strategy::io_uring:
+            return "io_uring";
+        case copy_strategy::delta:
+            return "delta";
+        case copy_strategy::hardlink:
+            return "hard link";
+        case copy_strategy::symlink:
+            return "symbolic link";
+    }
+    return "unknown";
+}
+
+double copy_stats_t::throughput() const {
+    const auto seconds = std::chrono::duration<double>(duration).count();
+    return seconds > 0 ? bytes / seconds : 0;
+}
+
+copy_stats_t copy_file_contents(
+    const path& source, const path& destination, const copy_opts_t& opts
+) {
+    if (opts.link != link_mode::copy) {
+        if (auto stats = link_file(source, destination, opts.link)) {
+            return *stats;
+        }
+    }
+    if (opts.delta_limit > 0) {
+        if (auto stats = update_in_place(source, destination, opts)) {
+            return *stats;
+        }
+    }
+    const auto staging_name = staging_path(destination, STAGING_SUFFIX);
+    const auto record_name = staging_path(destination, RECORD_SUFFIX);
+    // Destinations with names close to the limit can only be written directly
+    if (!opts.staged || !staging_name || !record_name) {
+        return copy_to(source, destination, opts, nullptr);
+    }
+    const path& staging = *staging_name;
+    const path& record = *record_name;
+    std::error_code e;
+    const uintmax_t size = std::filesystem::file_size(source, e);
+    const bool resumable = !e && opts.checkpoint_interval > 0 && size > opts.checkpoint_interval;
+
+    copy_stats_t stats;
+    try {
+        stats = copy_to(source, staging, opts, resumable ? &record : nullptr);
+    } catch (filesystem_error& err) {
+        // What we have of a resumable copy is kept for the next attempt if it
+        // was merely interrupted. Anything else, e.g. a full device, would
+        // fail the same way again, and the partial copy only takes up space.
+        if (resumable && is_interruption(err.code())) {
+            throw;
+        }
+        unlink(staging.c_str());
+        unlink(record.c_str());
+        // Staging needs room for both copies while replacing a file, so
+        // overwrite the destination directly if that is what we lacked
+        struct stat dest_st;
+        if (err.code() == std::errc::no_space_on_device &&
+            stat(destination.c_str(), &dest_st) == 0 && S_ISREG(dest_st.st_mode)) {
+            return copy_to(source, destination, opts, nullptr);
+        }
+        throw;
+    }
+    if (rename(staging.c_str(), destination.c_str()) != 0) {
+        throw_errno("Could not move staged copy into place", staging, destination);
+    }
+    if (resumable) {
+        unlink(record.c_str());
+    }
+    return stats;
+}
+
+std::optional<path> staged_destination(const path& p) {
+    const std::string name = p.filename().string();
+    for (const auto suffix : {STAGING_SUFFIX, RECORD_SUFFIX, LINK_SUFFIX}) {
+        if (name.size() > suffix.size() + 1 && name.starts_with('.') && name.ends_with(suffix)) {
+            return p.parent_path() / name.substr(1, name.size() - suffix.size() - 1);
+        }
+    }
+    return std::nullopt;
+}
+
+}  // namespace ddb_ows
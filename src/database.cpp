@@ -5,15 +5,17 @@
 #include <spdlog/spdlog.h>
 #include <sqlite3.h>
 
+#include <map>
 #include <mutex>
 #include <nlohmann/json.hpp>
+#include <set>
 #include <stdexcept>
 
 #include "constants.hpp"
 
 #define DDB_OWS_DATABASE_FNAME ".ddb_ows.json"
 #define DDB_OWS_SQL_DATABASE_FNAME ".ddb_ows.sqlite3"
-#define DDB_OWS_DATABASE_SCHEMA_VERSION 2
+#define DDB_OWS_DATABASE_SCHEMA_VERSION 6
 
 using namespace nlohmann;
 
@@ -37,7 +39,27 @@ struct db_version_info_t {
     std::string app_version;
 };
 
-Database::Database(path root) : m() {
+const db_opts_t Database::default_opts = {
+    .batch_size = 1,
+    .flush_ms = 0,
+    .journal_mode = "delete",
+    .synchronous = "full",
+    .cache_size = -2000,
+    .mmap_size = 0,
+    .temp_store = "default",
+    .fast_until_checkpoint = false,
+};
+
+// Pragma values end up in SQL, so those that are not numbers have to be one of
+// these
+const std::map<std::string, std::set<std::string>> pragma_values{
+    {"journal_mode", {"delete", "truncate", "persist", "memory", "wal", "off"}},
+    {"synchronous", {"off", "normal", "full", "extra"}},
+    {"temp_store", {"default", "file", "memory"}},
+};
+
+Database::Database(path root, const db_opts_t& _opts) :
+    m(), batch_size(_opts.batch_size), flush_interval(_opts.flush_ms), opts(_opts) {
     logger = spdlog::get(DDB_OWS_PROJECT_ID);
     db_fname = root / DDB_OWS_SQL_DATABASE_FNAME;
     int status = sqlite3_open_v2(
@@ -50,6 +72,11 @@ Database::Database(path root) : m() {
     }
     // Database opened successfully
 
+    _apply_pragmas(opts.fast_until_checkpoint);
+    _pragma("cache_size", std::to_string(opts.cache_size));
+    _pragma("mmap_size", std::to_string(opts.mmap_size));
+    _pragma("temp_store", opts.temp_store);
+
     // Make sure a meta table exists and get the schema and app versions from
     // it.
     // Preparing the statement can't fail because we control it fully.
@@ -108,6 +135,7 @@ Database::Database(path root) : m() {
     // Prepare all the statements we will need later from embedded resources
     const std::vector<std::string> stmt_names{
         "latest_file_sync",
+        "latest_file_syncs",
         "new_sync",
         "register_file",
         "register_synced_file",
@@ -115,7 +143,18 @@ Database::Database(path root) : m() {
         "register_synced_playlist",
         "register_file_in_playlist",
         "clear_playlist",
-        "get_unreferenced_files"
+        "get_unreferenced_files",
+        "get_output_paths",
+        "register_output_path",
+        "get_cover_cache",
+        "register_cover",
+        "get_content_fingerprints",
+        "register_content_fingerprint",
+        "register_job_stats",
+        "register_sync_phases",
+        "get_sync_summaries",
+        "get_job_summaries",
+        "get_content_fingerprint"
     };
     for (const auto& n : stmt_names) {
         const auto resource_name = fmt::format("/ddb_ows/sql/{}.sql", n);
@@ -136,9 +175,25 @@ Database::Database(path root) : m() {
         }
         statements.try_emplace(n, stmt, sqlite3_finalize);
     }
+
+    if (batch_size > 1 && flush_interval.count() > 0) {
+        flusher = std::jthread([this](std::stop_token stop) {
+            std::unique_lock lock(m);
+            while (!stop.stop_requested()) {
+                flush_cv.wait_for(lock, stop, flush_interval, [] { return false; });
+                _commit();
+            }
+        });
+    }
 }
 
 Database::~Database() {
+    if (flusher.joinable()) {
+        flusher.request_stop();
+        flusher.join();
+    }
+    checkpoint();
+
     // We have to destruct statements before closing the database
     statements.clear();
     sqlite3_close(sql_db);
@@ -146,6 +201,13 @@ Database::~Database() {
     logger->debug("Closed database {}.", db_fname);
 }
 
+// Inverse of file_time_type::time_since_epoch().count(), for timestamps
+// stored in the database
+std::filesystem::file_time_type file_time_from_int(int64_t ticks) {
+    using file_time = std::filesystem::file_time_type;
+    return file_time(file_time::duration(ticks));
+}
+
 // Convenience function to bind a text parameter from a std::string_view, or from
 // anything that *can be converted* to a std::string_view -- the compiler will write
 // the boilerplate for us. The default destructor is SQLITE_TRANSIENT because
@@ -163,13 +225,137 @@ int sqlite3_bind_str(
     return sqlite3_bind_text(stmt, idx, str.data(), str.length(), destructor);
 }
 
-// Get a prepared statement and make sure it is reset and ready to be used
+// Get a prepared statement and make sure it is reset and ready to be used.
+// Bindings survive a reset, so clear them too; otherwise an optional parameter
+// left unbound would silently reuse the previous call's value.
 sqlite3_stmt* Database::_get_statement(const std::string& name) {
     sqlite3_stmt* stmt = statements.at(name).get();
     sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
     return stmt;
 }
 
+void Database::_begin_write() {
+    if (in_transaction || batch_size <= 1) {
+        return;
+    }
+    int status = sqlite3_exec(sql_db, "BEGIN TRANSACTION", nullptr, nullptr, nullptr);
+    if (status != SQLITE_OK) {
+        // Not fatal; the write will simply be committed on its own
+        logger->warn(
+            "Could not begin transaction (errno {}: {})", status, sqlite3_errmsg(sql_db)
+        );
+        return;
+    }
+    in_transaction = true;
+}
+
+void Database::_end_write(sqlite3_stmt* stmt) {
+    // A statement that has not been reset counts as pending and would block
+    // the commit
+    sqlite3_reset(stmt);
+    if (!in_transaction) {
+        return;
+    }
+    if (++n_pending >= batch_size) {
+        _commit();
+    }
+}
+
+void Database::_commit() {
+    if (!in_transaction) {
+        return;
+    }
+    int status = sqlite3_exec(sql_db, "COMMIT", nullptr, nullptr, nullptr);
+    if (status != SQLITE_OK) {
+        // The transaction is still open, so we will try again on the next
+        // commit
+        logger->warn(
+            "Could not commit {} pending writes (errno {}: {})",
+            n_pending,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return;
+    }
+    logger->trace("Committed {} writes to {}", n_pending, db_fname);
+    in_transaction = false;
+    n_pending = 0;
+}
+
+void Database::flush() {
+    std::lock_guard lock(m);
+    _commit();
+}
+
+// Sets a pragma and returns its resulting value, which may differ from the one
+// requested, or nullopt on error
+std::optional<std::string> Database::_pragma(const std::string& name, const std::string& value) {
+    const auto allowed = pragma_values.find(name);
+    if (allowed != pragma_values.end() && !allowed->second.contains(value)) {
+        logger->warn("Invalid value {} for database pragma {}", value, name);
+        return std::nullopt;
+    }
+    std::optional<std::string> out;
+    auto store_value = [](void* user_data, int n_cols, char** cols, char** col_names) -> int {
+        if (n_cols > 0 && cols[0] != nullptr) {
+            *static_cast<std::optional<std::string>*>(user_data) = cols[0];
+        }
+        return 0;
+    };
+    const auto sql = fmt::format("PRAGMA {} = {}", name, value);
+    int status = sqlite3_exec(sql_db, sql.c_str(), store_value, &out, nullptr);
+    if (status != SQLITE_OK) {
+        logger->warn(
+            "Could not set database pragma {} = {} (errno {}: {})",
+            name,
+            value,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    // Not all pragmas report their new value
+    return out ? out : value;
+}
+
+void Database::_apply_pragmas(bool _fast) {
+    const std::string mode = _fast ? "memory" : opts.journal_mode;
+    auto actual = _pragma("journal_mode", mode);
+    if (mode == "wal" && actual != "wal") {
+        // WAL needs shared memory, which some file systems can't provide
+        logger->warn("Write-ahead log not supported for {}, using truncate journal", db_fname);
+        actual = _pragma("journal_mode", "truncate");
+    }
+    journal_mode = actual.value_or("");
+    _pragma("synchronous", _fast ? "off" : opts.synchronous);
+    fast = _fast;
+    logger->debug(
+        "Database {} uses journal mode {}{}", db_fname, journal_mode, fast ? " (fast profile)" : ""
+    );
+}
+
+void Database::checkpoint() {
+    std::lock_guard lock(m);
+    _commit();
+    if (in_transaction) {
+        // The commit failed; pragmas can't be changed inside a transaction
+        return;
+    }
+    if (fast) {
+        _apply_pragmas(false);
+    }
+    if (journal_mode == "wal") {
+        int status =
+            sqlite3_exec(sql_db, "PRAGMA wal_checkpoint(TRUNCATE)", nullptr, nullptr, nullptr);
+        if (status != SQLITE_OK) {
+            logger->warn(
+                "Could not checkpoint database (errno {}: {})", status, sqlite3_errmsg(sql_db)
+            );
+        }
+    }
+}
+
 std::optional<sync_id_t> Database::new_sync(
     const std::string& fn_format,
     bool cover_sync,
@@ -177,6 +363,7 @@ std::optional<sync_id_t> Database::new_sync(
     bool rm_unref
 ) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("new_sync");
     sqlite3_bind_str(stmt, ":ddb_ows_version", DDB_OWS_VERSION);
@@ -190,48 +377,208 @@ std::optional<sync_id_t> Database::new_sync(
         sqlite3_bind_null(stmt, idx);
     }
     int status = sqlite3_step(stmt);
+    std::optional<sync_id_t> out;
     if (status != SQLITE_ROW) {
         logger->warn(
             "Could not create a new sync in database (errno {}: {})", status, sqlite3_errmsg(sql_db)
         );
-        return std::nullopt;
     } else {
-        return sqlite3_column_int64(stmt, 0);
+        out = sqlite3_column_int64(stmt, 0);
     }
+    _end_write(stmt);
+    return out;
 }
 
-std::optional<synced_file_data_t> Database::find_entry(path key) {
+void Database::register_sync_phases(sync_id_t sync_id, const sync_phases_t& phases) {
     std::lock_guard lock(m);
+    _begin_write();
+
+    sqlite3_stmt* stmt = _get_statement("register_sync_phases");
+    for (const auto& [param, duration] : {
+             std::pair{":save_playlists_ms", phases.save_playlists},
+             std::pair{":gather_ms", phases.gather},
+             std::pair{":plan_ms", phases.plan},
+             std::pair{":cover_ms", phases.cover},
+             std::pair{":execute_ms", phases.execute},
+         })
+    {
+        sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, param), duration.count());
+    }
+    sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":sync_id"), sync_id);
 
-    sqlite3_stmt* stmt = _get_statement("latest_file_sync");
-    sqlite3_bind_str(stmt, ":source", key.string());
+    int status = sqlite3_step(stmt);
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not register phases of sync {} (errno {}): {}",
+            sync_id,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+    }
+    _end_write(stmt);
+}
+
+void Database::register_job_stats(const job_record_t& record) {
+    std::lock_guard lock(m);
+    _begin_write();
+
+    sqlite3_stmt* stmt = _get_statement("register_job_stats");
+    sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":sync_id"), record.sync_id);
+    sqlite3_bind_str(stmt, ":source", record.source.string());
+    sqlite3_bind_str(stmt, ":destination", record.destination.string());
+    sqlite3_bind_str(stmt, ":kind", record.kind);
+    if (!record.strategy.empty()) {
+        sqlite3_bind_str(stmt, ":strategy", record.strategy);
+    }
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":bytes_read"), record.bytes_read
+    );
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":bytes_written"), record.bytes_written
+    );
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":duration_us"), record.duration.count()
+    );
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":success"), record.success);
 
     int status = sqlite3_step(stmt);
-    if (status == SQLITE_ROW) {
-        const auto source = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not register stats of job for {} (errno {}): {}",
+            record.source,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+    }
+    _end_write(stmt);
+}
 
-        std::optional<path> destination;
-        const auto dest = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        if (dest != nullptr) {
-            destination = dest;
-        }
+double sync_summary_t::throughput() const {
+    if (!phases || phases->execute.count() <= 0) {
+        return 0;
+    }
+    return bytes_written / std::chrono::duration<double>(phases->execute).count();
+}
+
+std::optional<std::vector<sync_summary_t>> Database::get_sync_summaries(size_t limit) {
+    using namespace std::chrono;
+    std::lock_guard lock(m);
 
-        std::optional<std::string> conv_preset;
-        const auto conv_preset_ = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        if (conv_preset_ != nullptr) {
-            conv_preset = conv_preset_;
+    sqlite3_stmt* stmt = _get_statement("get_sync_summaries");
+    sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":limit"), limit);
+
+    std::vector<sync_summary_t> out;
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        std::optional<sync_phases_t> phases;
+        // All phases are recorded together
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+            phases = sync_phases_t{
+                .save_playlists = milliseconds(sqlite3_column_int64(stmt, 2)),
+                .gather = milliseconds(sqlite3_column_int64(stmt, 3)),
+                .plan = milliseconds(sqlite3_column_int64(stmt, 4)),
+                .cover = milliseconds(sqlite3_column_int64(stmt, 5)),
+                .execute = milliseconds(sqlite3_column_int64(stmt, 6)),
+            };
         }
+        out.push_back({
+            .sync_id = static_cast<sync_id_t>(sqlite3_column_int64(stmt, 0)),
+            .timestamp = seconds(sqlite3_column_int64(stmt, 1)),
+            .phases = phases,
+            .n_jobs = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 7)),
+            .n_failed = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 8)),
+            .bytes_read = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 9)),
+            .bytes_written = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 10)),
+            .job_time = microseconds(sqlite3_column_int64(stmt, 11)),
+        });
+    }
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for sync summaries (errno {}): {}",
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    return out;
+}
+
+std::optional<std::vector<job_summary_t>> Database::get_job_summaries(sync_id_t sync_id) {
+    using namespace std::chrono;
+    std::lock_guard lock(m);
+
+    sqlite3_stmt* stmt = _get_statement("get_job_summaries");
+    sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":sync_id"), sync_id);
+
+    std::vector<job_summary_t> out;
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const auto strategy = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        out.push_back({
+            .kind = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+            .strategy = strategy != nullptr ? strategy : "",
+            .n_jobs = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 2)),
+            .n_failed = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 3)),
+            .bytes_read = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 4)),
+            .bytes_written = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 5)),
+            .job_time = microseconds(sqlite3_column_int64(stmt, 6)),
+            .max_job_time = microseconds(sqlite3_column_int64(stmt, 7)),
+        });
+    }
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for job summaries of sync {} (errno {}): {}",
+            sync_id,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    return out;
+}
+
+// Reads a row with the columns of latest_file_sync.sql
+synced_file_data_t read_synced_file(sqlite3_stmt* stmt) {
+    using path = std::filesystem::path;
+
+    const auto source = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+
+    std::optional<path> destination;
+    const auto dest = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    if (dest != nullptr) {
+        destination = dest;
+    }
+
+    std::optional<std::string> conv_preset;
+    const auto conv_preset_ = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+    if (conv_preset_ != nullptr) {
+        conv_preset = conv_preset_;
+    }
 
-        const uint64_t ts = sqlite3_column_int64(stmt, 3);
-        const sync_id_t sync_id = sqlite3_column_int64(stmt, 4);
+    const uint64_t ts = sqlite3_column_int64(stmt, 3);
+    const sync_id_t sync_id = sqlite3_column_int64(stmt, 4);
+
+    return {
+        .sync_id = sync_id,
+        .source = path(source),
+        .destination = destination,
+        .converter_preset = conv_preset,
+        .timestamp = std::chrono::seconds(ts),
+    };
+}
+
+std::optional<synced_file_data_t> Database::find_entry(path key) {
+    std::lock_guard lock(m);
 
-        return {{
-            .sync_id = sync_id,
-            .source = path(source),
-            .destination = destination,
-            .converter_preset = conv_preset,
-            .timestamp = std::chrono::seconds(ts),
-        }};
+    sqlite3_stmt* stmt = _get_statement("latest_file_sync");
+    sqlite3_bind_str(stmt, ":source", key.string());
+
+    int status = sqlite3_step(stmt);
+    if (status == SQLITE_ROW) {
+        auto out = read_synced_file(stmt);
+        // Release the read lock so that it does not block commits
+        sqlite3_reset(stmt);
+        return out;
     } else if (status == SQLITE_DONE) {  // No data returned
         return std::nullopt;
     } else {
@@ -245,6 +592,29 @@ std::optional<synced_file_data_t> Database::find_entry(path key) {
     }
 }
 
+std::optional<sync_snapshot_t> Database::get_snapshot() {
+    std::lock_guard lock(m);
+
+    sqlite3_stmt* stmt = _get_statement("latest_file_syncs");
+
+    sync_snapshot_t out;
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto data = read_synced_file(stmt);
+        auto key = data.source.string();
+        out.try_emplace(std::move(key), std::move(data));
+    }
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for latest syncs (errno {}): {}",
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    return out;
+}
+
 std::optional<std::vector<std::tuple<std::filesystem::path, std::filesystem::path>>>
 Database::get_unreferenced_files() {
     std::lock_guard lock(m);
@@ -269,8 +639,210 @@ Database::get_unreferenced_files() {
     return out;
 }
 
+std::optional<output_paths_t> Database::get_output_paths() {
+    std::lock_guard lock(m);
+
+    sqlite3_stmt* stmt = _get_statement("get_output_paths");
+
+    output_paths_t out;
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const auto source = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        const uint64_t fingerprint = sqlite3_column_int64(stmt, 1);
+        const auto output_path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        out.try_emplace(source, fingerprint, output_path);
+    }
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for output paths (errno {}): {}",
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    return out;
+}
+
+bool Database::register_output_path(const path& source, const output_path_data_t& data) {
+    std::lock_guard lock(m);
+    _begin_write();
+
+    sqlite3_stmt* stmt = _get_statement("register_output_path");
+    sqlite3_bind_str(stmt, ":source", source.string());
+    sqlite3_bind_str(stmt, ":output_path", data.output_path.string());
+    // SQLite integers are signed, but the bits are all we care about
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":fingerprint"), data.fingerprint
+    );
+
+    int status = sqlite3_step(stmt);
+    bool stored = status == SQLITE_DONE && sqlite3_changes(sql_db) > 0;
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not register output path of {} (errno {}): {}",
+            source,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+    }
+    _end_write(stmt);
+    return stored;
+}
+
+std::optional<cover_cache_t> Database::get_cover_cache() {
+    std::lock_guard lock(m);
+
+    sqlite3_stmt* stmt = _get_statement("get_cover_cache");
+
+    cover_cache_t out;
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const auto source_dir = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        const auto image_filename = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        out.try_emplace(
+            source_dir,
+            cover_cache_entry_t{
+                .dir_mtime = file_time_from_int(sqlite3_column_int64(stmt, 1)),
+                .image_filename = image_filename,
+                .image_mtime = file_time_from_int(sqlite3_column_int64(stmt, 3)),
+            }
+        );
+    }
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for cached covers (errno {}): {}",
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    return out;
+}
+
+void Database::register_cover(const path& source_dir, const cover_cache_entry_t& entry) {
+    std::lock_guard lock(m);
+    _begin_write();
+
+    sqlite3_stmt* stmt = _get_statement("register_cover");
+    sqlite3_bind_str(stmt, ":source_dir", source_dir.string());
+    sqlite3_bind_str(stmt, ":image_filename", entry.image_filename.string());
+    sqlite3_bind_int64(
+        stmt,
+        sqlite3_bind_parameter_index(stmt, ":dir_mtime"),
+        entry.dir_mtime.time_since_epoch().count()
+    );
+    sqlite3_bind_int64(
+        stmt,
+        sqlite3_bind_parameter_index(stmt, ":image_mtime"),
+        entry.image_mtime.time_since_epoch().count()
+    );
+
+    int status = sqlite3_step(stmt);
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not cache cover of {} (errno {}): {}",
+            source_dir,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+    }
+    _end_write(stmt);
+}
+
+// Reads the fingerprint from a row with the columns of
+// get_content_fingerprints.sql
+content_fingerprint_entry_t read_content_fingerprint(sqlite3_stmt* stmt) {
+    return {
+        .mtime = file_time_from_int(sqlite3_column_int64(stmt, 1)),
+        .method = static_cast<fingerprint_method>(sqlite3_column_int(stmt, 2)),
+        .fingerprint =
+            {.size = static_cast<uintmax_t>(sqlite3_column_int64(stmt, 3)),
+             .hash = static_cast<uint64_t>(sqlite3_column_int64(stmt, 4))},
+    };
+}
+
+std::optional<content_fingerprints_t> Database::get_content_fingerprints() {
+    std::lock_guard lock(m);
+
+    sqlite3_stmt* stmt = _get_statement("get_content_fingerprints");
+
+    content_fingerprints_t out;
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const auto source = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        out.try_emplace(source, read_content_fingerprint(stmt));
+    }
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for content fingerprints (errno {}): {}",
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+        return std::nullopt;
+    }
+    return out;
+}
+
+std::optional<content_fingerprint_entry_t> Database::get_content_fingerprint(const path& source) {
+    std::lock_guard lock(m);
+
+    sqlite3_stmt* stmt = _get_statement("get_content_fingerprint");
+    sqlite3_bind_str(stmt, ":source", source.string());
+
+    int status = sqlite3_step(stmt);
+    if (status == SQLITE_ROW) {
+        auto out = read_content_fingerprint(stmt);
+        // Release the read lock so that it does not block commits
+        sqlite3_reset(stmt);
+        return out;
+    } else if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not query database for content fingerprint of {} (errno {}): {}",
+            source,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+    }
+    return std::nullopt;
+}
+
+void Database::register_content_fingerprint(
+    const path& source, const content_fingerprint_entry_t& entry
+) {
+    std::lock_guard lock(m);
+    _begin_write();
+
+    sqlite3_stmt* stmt = _get_statement("register_content_fingerprint");
+    sqlite3_bind_str(stmt, ":source", source.string());
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":mtime"), entry.mtime.time_since_epoch().count()
+    );
+    sqlite3_bind_int(
+        stmt, sqlite3_bind_parameter_index(stmt, ":method"), static_cast<int>(entry.method)
+    );
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":size"), entry.fingerprint.size
+    );
+    // SQLite integers are signed, but the bits are all we care about
+    sqlite3_bind_int64(
+        stmt, sqlite3_bind_parameter_index(stmt, ":hash"), entry.fingerprint.hash
+    );
+
+    int status = sqlite3_step(stmt);
+    if (status != SQLITE_DONE) {
+        logger->warn(
+            "Could not register content fingerprint of {} (errno {}): {}",
+            source,
+            status,
+            sqlite3_errmsg(sql_db)
+        );
+    }
+    _end_write(stmt);
+}
+
 void Database::register_file(const path& source) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("register_file");
     sqlite3_bind_str(stmt, ":source", source.string());
@@ -282,10 +854,12 @@ void Database::register_file(const path& source) {
             "Could not register file {} (errno {}): {}", source, status, sqlite3_errmsg(sql_db)
         );
     }
+    _end_write(stmt);
 }
 
 void Database::register_synced_file(const synced_file_data_t& data) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("register_synced_file");
 
@@ -311,10 +885,12 @@ void Database::register_synced_file(const synced_file_data_t& data) {
             sqlite3_errmsg(sql_db)
         );
     }
+    _end_write(stmt);
 }
 
 void Database::register_playlist(std::string_view uuid, std::string_view title) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("register_playlist");
     sqlite3_bind_str(stmt, ":uuid", uuid, SQLITE_STATIC);
@@ -331,10 +907,12 @@ void Database::register_playlist(std::string_view uuid, std::string_view title)
             sqlite3_errmsg(sql_db)
         );
     }
+    _end_write(stmt);
 }
 
 void Database::register_synced_playlist(std::string_view uuid, sync_id_t sync_id) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("register_synced_playlist");
     sqlite3_bind_str(stmt, ":uuid", uuid);
@@ -350,10 +928,12 @@ void Database::register_synced_playlist(std::string_view uuid, sync_id_t sync_id
             sqlite3_errmsg(sql_db)
         );
     }
+    _end_write(stmt);
 }
 
 void Database::register_file_in_playlist(const path& source, std::string_view plt_uuid) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("register_file_in_playlist");
     sqlite3_bind_str(stmt, ":source", source.string());
@@ -370,10 +950,12 @@ void Database::register_file_in_playlist(const path& source, std::string_view pl
             sqlite3_errmsg(sql_db)
         );
     }
+    _end_write(stmt);
 }
 
 void Database::clear_playlist(std::string_view plt_uuid) {
     std::lock_guard lock(m);
+    _begin_write();
 
     sqlite3_stmt* stmt = _get_statement("clear_playlist");
     sqlite3_bind_str(stmt, ":playlist_uuid", plt_uuid, SQLITE_STATIC);
@@ -388,6 +970,7 @@ void Database::clear_playlist(std::string_view plt_uuid) {
             sqlite3_errmsg(sql_db)
         );
     }
+    _end_write(stmt);
 }
 
 }  // namespace ddb_ows
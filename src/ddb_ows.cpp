@@ -5,32 +5,49 @@
 #include <fmt/chrono.h>
 // for formatting std::filesystem::path
 #include <fmt/std.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
 #include <condition_variable>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <random>
 #include <set>
+#include <span>
 #include <stop_token>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "concurrency.hpp"
 #include "constants.hpp"
 #include "database.hpp"
+#include "dest_index.hpp"
+#include "fingerprint.hpp"
+#include "hash.hpp"
+#include "io_limiter.hpp"
 #include "job.hpp"
 #include "jobsqueue.hpp"
 #include "playlist_uuid.hpp"
+#include "transcode_cache.hpp"
 
 using namespace std::chrono_literals;
 using namespace std::chrono;
@@ -49,6 +66,12 @@ struct ddb_ows_plugin_int {
     std::condition_variable running_cv;
     bool running = false;
     std::shared_ptr<JobsQueue> jobs;
+    // Shared by the copies of the running sync
+    std::shared_ptr<WriteBudget> write_budget;
+    // Shared by all workers
+    std::shared_ptr<IoLimiter> limiter;
+    // Null if disabled
+    std::shared_ptr<TranscodeCache> transcode_cache;
     std::shared_ptr<spdlog::logger> logger;
     std::unordered_set<std::string> conv_exts;
 };
@@ -98,6 +121,7 @@ plt_uuid _plt_get_uuid(ddb_playlist_t* plt) { return plt_get_uuid(plt, ddb); }
 std::remove_reference_t<decltype(*ddb_ows_plugin_t::run)> run;
 std::remove_reference_t<decltype(*ddb_ows_plugin_t::cancel)> cancel;
 std::remove_reference_t<decltype(*ddb_ows_plugin_t::get_output_path)> get_output_path;
+std::remove_reference_t<decltype(*ddb_ows_plugin_t::set_io_limits)> set_io_limits;
 
 ddb_ows_plugin_t plugin_public = {
     .plugin = plugin_ddb,
@@ -105,6 +129,7 @@ ddb_ows_plugin_t plugin_public = {
     .cancel = cancel,
     .get_output_path = get_output_path,
     .plt_get_uuid = _plt_get_uuid,
+    .set_io_limits = set_io_limits,
 };
 
 ddb_ows_plugin_int plugin = {
@@ -156,151 +181,583 @@ std::string get_output_path(DB_playItem_t* it, char* format) {
     return std::string(out);
 }
 
-struct cover_req_t {
+using tf_ptr = std::unique_ptr<char, decltype(ddb->tf_free)>;
+using field_set = std::unordered_set<std::string>;
+
+// Title formatting falls back to other fields when some fields are missing;
+// e.g., %album artist% uses the artist if there is no album artist. Lists the
+// fields each field might read, erring on the side of too many.
+const std::unordered_map<std::string, field_set> field_aliases{
+    {"artist", {"album artist", "albumartist", "band", "performer", "composer"}},
+    {"album artist", {"albumartist", "band", "artist", "performer", "composer"}},
+    {"albumartist", {"album artist", "band", "artist"}},
+    {"track artist", {"artist", "album artist", "albumartist", "band"}},
+    {"album", {"venue"}},
+    {"tracknumber", {"track"}},
+    {"track number", {"track", "tracknumber"}},
+    {"year", {"date", "original_release_date"}},
+    {"date", {"year"}},
+    {"disc", {"discnumber"}},
+    {"discnumber", {"disc"}},
+    {"disc number", {"disc", "discnumber"}},
+    {"totaldiscs", {"numdiscs", "disctotal"}},
+    {"totaltracks", {"numtracks", "tracktotal"}},
+};
+
+// Finds the metadata fields a title format string may read. Returns nullopt if
+// that can't be determined, e.g., if a field name is itself computed.
+std::optional<field_set> referenced_fields(std::string_view format) {
+    field_set fields;
+    auto add = [&fields](std::string_view name) {
+        std::string key(name);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        if (auto aliases = field_aliases.find(key); aliases != field_aliases.end()) {
+            fields.insert(aliases->second.begin(), aliases->second.end());
+        }
+        fields.insert(std::move(key));
+    };
+
+    size_t i = 0;
+    while (i < format.size()) {
+        if (format[i] == '\'') {
+            // Quoted literal text
+            const auto end = format.find('\'', i + 1);
+            if (end == std::string_view::npos) {
+                return std::nullopt;
+            }
+            i = end + 1;
+        } else if (format[i] == '%') {
+            const auto end = format.find('%', i + 1);
+            if (end == std::string_view::npos) {
+                return std::nullopt;
+            }
+            add(format.substr(i + 1, end - i - 1));
+            i = end + 1;
+        } else if (format.substr(i, 2) == "$$") {
+            // Literal $
+            i += 2;
+        } else if (format[i] == '$') {
+            // A function name, which its arguments follow immediately
+            size_t paren = i + 1;
+            while (paren < format.size() &&
+                   (std::isalnum(static_cast<unsigned char>(format[paren])) ||
+                    format[paren] == '_')) {
+                paren++;
+            }
+            if (paren == i + 1 || paren == format.size() || format[paren] != '(') {
+                return std::nullopt;
+            }
+            // $meta(), $meta_sep() etc. take the name of a field as their first
+            // argument
+            if (format.substr(i + 1, paren - i - 1).starts_with("meta")) {
+                const auto end = format.find_first_of(",)", paren + 1);
+                const auto name = format.substr(paren + 1, end - paren - 1);
+                if (end == std::string_view::npos || name.find_first_of("%$'[") != name.npos) {
+                    return std::nullopt;
+                }
+                add(name);
+            }
+            i = paren + 1;
+        } else {
+            i++;
+        }
+    }
+    return fields;
+}
+
+// A compiled title format, and the metadata fields it reads if those could be
+// determined
+struct title_format {
+    tf_ptr bc;
+    std::optional<field_set> fields;
+
+    title_format(const std::string& str) :
+        bc(ddb->tf_compile(str.c_str()), ddb->tf_free), fields(referenced_fields(str)) {}
+
+    // Whether the field with this key might affect the output. Technical
+    // fields, whose keys start with ':', are always included; e.g., %path%
+    // reads :URI.
+    bool reads(const char* key, std::string& lower) const {
+        if (!fields || key[0] == ':') {
+            return true;
+        }
+        lower = key;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        return fields->contains(lower);
+    }
+};
+
+// Reused by each thread across calls to get_output_path, so that copying
+// metadata does not allocate once the buffers have grown large enough
+struct tf_scratch_t {
+    DB_playItem_t* it = nullptr;
+    std::string key;
+    std::string value;
+
+    ~tf_scratch_t() {
+        if (it != nullptr) {
+            ddb->pl_item_unref(it);
+        }
+    }
+};
+
+thread_local tf_scratch_t tf_scratch;
+
+// Like get_output_path above, but only copies and escapes the fields format
+// reads, into a per-thread scratch item
+std::string get_output_path(DB_playItem_t* it, const title_format& format) {
+    auto& scratch = tf_scratch;
+    if (scratch.it == nullptr) {
+        scratch.it = ddb->pl_item_alloc();
+    }
+
+    ddb->pl_lock();
+    DB_metaInfo_t* meta;
+    while ((meta = ddb->pl_get_metadata_head(scratch.it)) != nullptr) {
+        ddb->pl_delete_metadata(scratch.it, meta);
+    }
+    for (meta = ddb->pl_get_metadata_head(it); meta != nullptr; meta = meta->next) {
+        if (!format.reads(meta->key, scratch.key)) {
+            continue;
+        }
+        scratch.value = meta->value;
+        escape(scratch.value);
+        ddb->pl_add_meta(scratch.it, meta->key, scratch.value.c_str());
+    }
+    ddb->pl_unlock();
+
+    char out[PATH_MAX];
+    ddb_tf_context_t ctx = {
+        ._size = sizeof(ddb_tf_context_t),
+        .flags = 0,
+        .it = scratch.it,
+        .plt = nullptr,
+        .idx = 0,
+        .id = 0,
+        .iter = PL_MAIN,
+    };
+    ddb->tf_eval(&ctx, format.bc.get(), out, sizeof(out));
+    return std::string(out);
+}
+
+// Output paths are persisted in the database together with a fingerprint of
+// the title format and the metadata they were computed from, so that unchanged
+// tracks can skip title formatting on later syncs. Safe to use from several
+// threads.
+class OutputPathCache {
+  public:
+    OutputPathCache(DatabaseHandle _db, const std::string& format, bool _read_only) :
+        db(_db), format_hash(fnv1a(format)), read_only(_read_only) {
+        auto stored = db->get_output_paths();
+        if (!stored) {
+            return;
+        }
+        for (auto& [source, data] : *stored) {
+            paths.try_emplace(source, cached_path{.data = std::move(data), .persisted = true});
+        }
+    }
+
+    // Returns the output path of it, evaluating format only if the format or
+    // the metadata changed since the path was cached
+    std::string get(DB_playItem_t* it, const title_format& format) {
+        const auto [source, fingerprint] = get_fingerprint(it, format);
+        {
+            std::lock_guard lock(m);
+            auto entry = paths.find(source);
+            if (entry != paths.end() && entry->second.data.fingerprint == fingerprint) {
+                persist(source, entry->second);
+                return entry->second.data.output_path;
+            }
+        }
+
+        std::string out = get_output_path(it, format);
+
+        std::lock_guard lock(m);
+        cached_path computed{.data = {.fingerprint = fingerprint, .output_path = out}};
+        auto entry = paths.insert_or_assign(source, std::move(computed)).first;
+        persist(source, entry->second);
+        return out;
+    }
+
+  private:
+    struct cached_path {
+        output_path_data_t data;
+        bool persisted = false;
+    };
+
+    DatabaseHandle db;
+    const uint64_t format_hash;
+    const bool read_only;
     std::mutex m;
-    std::condition_variable c;
-    bool returned = false;
-    bool timed_out = false;
-    ddb_cover_info_t* cover = nullptr;
+    std::unordered_map<std::string, cached_path> paths;
+
+    // Returns the source path of it and the fingerprint of the metadata that
+    // format reads
+    std::pair<std::string, uint64_t>
+    get_fingerprint(DB_playItem_t* it, const title_format& format) {
+        std::string source;
+        std::string key;
+        uint64_t hash = format_hash;
+        ddb->pl_lock();
+        for (auto meta = ddb->pl_get_metadata_head(it); meta != nullptr; meta = meta->next) {
+            if (!format.reads(meta->key, key)) {
+                continue;
+            }
+            hash = fnv1a_field(meta->key, hash);
+            hash = fnv1a_field(meta->value, hash);
+            if (strcmp(meta->key, ":URI") == 0) {
+                source = meta->value;
+            }
+        }
+        ddb->pl_unlock();
+        return {source, hash};
+    }
+
+    // Must be called with m held. The source may not have been registered in
+    // the database yet, e.g. while saving playlists, so we retry until it is.
+    void persist(const std::string& source, cached_path& entry) {
+        if (!entry.persisted && !read_only) {
+            entry.persisted = db->register_output_path(source, entry.data);
+        }
+    }
 };
 
-void callback_cover_art_found(int error, ddb_cover_query_t* query, ddb_cover_info_t* cover) {
-    auto creq = static_cast<std::shared_ptr<cover_req_t>*>(query->user_data);
+// Cover requests that have completed, shared between the artwork plugin's
+// callbacks and queue_cover_jobs. Outlives queue_cover_jobs if requests are
+// still outstanding when it returns.
+struct cover_completions_t {
+    std::mutex m;
+    std::condition_variable_any c;
+    // Set once nobody collects completions anymore
+    bool closed = false;
+    std::deque<std::pair<size_t, ddb_cover_info_t*>> done;
+
+    void close() {
+        std::lock_guard lock(m);
+        closed = true;
+        for (auto [_, cover] : done) {
+            release_cover(cover);
+        }
+        done.clear();
+    }
 
-    auto logger = spdlog::get(DDB_OWS_PROJECT_ID);
+    static void release_cover(ddb_cover_info_t* cover) {
+        if (cover != nullptr) {
+            ddb_artwork->cover_info_release(cover);
+        }
+    }
+};
+
+struct cover_req_t {
+    std::shared_ptr<cover_completions_t> completions;
+    size_t id;
+};
+
+void callback_cover_art_found(int error, ddb_cover_query_t* query, ddb_cover_info_t* cover) {
+    auto creq = static_cast<cover_req_t*>(query->user_data);
 
+    if ((query->flags & DDB_ARTWORK_FLAG_CANCELLED) || cover == nullptr ||
+        cover->image_filename == nullptr)
     {
-        std::lock_guard<std::mutex> lock((*creq)->m);
-        if (!(*creq)->timed_out) {
-            (*creq)->returned = true;
-            if ((query->flags & DDB_ARTWORK_FLAG_CANCELLED) || cover == nullptr ||
-                cover->image_filename == nullptr)
-            {
-                (*creq)->cover = nullptr;
-            } else {
-                logger->debug("Found cover: {}", cover->image_filename);
-                (*creq)->cover = cover;
-            }
+        cover_completions_t::release_cover(cover);
+        cover = nullptr;
+    }
+    {
+        std::lock_guard lock(creq->completions->m);
+        if (creq->completions->closed) {
+            cover_completions_t::release_cover(cover);
+        } else {
+            creq->completions->done.emplace_back(creq->id, cover);
         }
     }
-    (*creq)->c.notify_all();
+    creq->completions->c.notify_all();
     delete creq;
     ddb->pl_item_unref(query->track);
     free(query);
 }
 
-bool is_newer(path a, path b) { return last_write_time(a) > last_write_time(b); }
+// Looks up the latest sync of source in a snapshot taken at the start of the
+// sync, or returns nullptr if it was never synced.
+const synced_file_data_t* find_entry(const sync_snapshot_t& snapshot, const path& source) {
+    auto entry = snapshot.find(source.string());
+    return entry != snapshot.end() ? &entry->second : nullptr;
+}
+
+copy_opts_t get_copy_opts(const ddb_ows_config& conf) {
+    copy_opts_t opts;
+    if (conf.link_mode == "hardlink") {
+        opts.link = link_mode::hardlink;
+    } else if (conf.link_mode == "symlink") {
+        opts.link = link_mode::symlink;
+    }
+    opts.backend =
+        conf.copy_backend == "io_uring" ? copy_backend::io_uring : copy_backend::standard;
+    opts.queue_depth = conf.copy_queue_depth;
+    opts.write_budget = plugin.write_budget;
+    opts.limiter = plugin.limiter;
+    opts.stop = plugin.stop.get_token();
+    opts.staged = true;
+    opts.checkpoint_interval = uintmax_t(conf.copy_checkpoint_mb) << 20;
+    opts.delta_limit = uintmax_t(conf.delta_limit_kb) << 10;
+    return opts;
+}
 
 struct cover_job_source {
     std::shared_ptr<ddb_playItem_t> it;
     std::unordered_set<std::string> plt_uuids;
 };
 
-using tf_ptr = std::unique_ptr<char, decltype(ddb->tf_free)>;
+struct cover_source_dir {
+    path dir;
+    std::filesystem::file_time_type mtime;
+};
+
+// Returns the directory of the item covers are requested for, which
+// identifies the album in the cover cache. Returns nullopt if it is not a
+// local directory.
+std::optional<cover_source_dir> get_cover_source_dir(const cover_job_source& src) {
+    ddb->pl_lock();
+    path dir = path(ddb->pl_find_meta(src.it.get(), ":URI")).parent_path();
+    ddb->pl_unlock();
+    std::error_code ec;
+    const auto mtime = last_write_time(dir, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    return cover_source_dir{.dir = dir, .mtime = mtime};
+}
 
+// Requests covers for every target directory in items, keeping up to
+// conf.cover_max_inflight requests in flight at once. Jobs are queued as
+// requests complete, so they are not queued in a deterministic order.
 // Returns false if cancelled, true if successful
 bool queue_cover_jobs(
     bool dry,
     const ddb_ows_config& conf,
     std::shared_ptr<Logger> logger,
     DatabaseHandle db,
+    const sync_snapshot_t& snapshot,
+    const DestinationIndex& dests,
     sync_id_t sync_id,
     const std::map<path, cover_job_source>& items,
     job_queued_cb_t queued_cb
 ) {
+    using clock = std::chrono::steady_clock;
     auto jobs = plugin.jobs;
     auto plug_logger = plugin.logger;
 
-    const auto tf_str = conf.fn_formats[0];
-    tf_ptr fmt(ddb->tf_compile(tf_str.c_str()), ddb->tf_free);
-    if (fmt.get() == nullptr) {
-        logger->err("Invalid title format string {}.", tf_str);
-        return false;
-    }
-
-    auto root = path(conf.root);
     std::random_device rd;
     std::mt19937 mersenne_twister(rd());
     auto dist = std::uniform_int_distribution<long>(LONG_MIN, LONG_MAX);
+    // All requests of this sync share a source id so that they can be
+    // cancelled together
+    const int64_t source_id = dist(mersenne_twister);
 
     const auto timeout = std::chrono::milliseconds(conf.cover_timeout_ms);
     const auto fname = conf.cover_fname;
-    for (const auto& [_, src] : items) {
+    const size_t max_inflight = std::max(1u, conf.cover_max_inflight);
+
+    struct pending_req {
+        clock::time_point deadline;
+        const path& target_dir;
+        const cover_job_source& src;
+        std::optional<cover_source_dir> source_dir;
+    };
+    std::unordered_map<size_t, pending_req> pending;
+    // Requests we gave up on, which the plugin is still working on, and when
+    // they stop counting. They keep their place in the window until they
+    // complete, or max_inflight would bound nothing with a slow plugin, but
+    // for at most another timeout, so that a plugin that never answers
+    // doesn't hold up the sync.
+    std::unordered_map<size_t, clock::time_point> timed_out;
+    auto completions = std::make_shared<cover_completions_t>();
+
+    auto request = [&](size_t id, const cover_job_source& src) {
         auto it = src.it.get();
-        if (plugin.stop.stop_requested()) {
-            plug_logger->debug("Cancelled while queueing cover jobs");
-            return false;
-        }
-        path item_source = ddb->pl_find_meta(it, ":URI");
-        path item_destination = root / get_output_path(it, fmt.get());
-        path target_dir = item_destination.parent_path();
         auto* cover_query = static_cast<ddb_cover_query_t*>(calloc(1, sizeof(ddb_cover_query_t)));
         cover_query->flags = 0;
         cover_query->track = it;
         ddb->pl_item_ref(it);
-        int64_t sid = dist(mersenne_twister);
-        cover_query->source_id = sid;
+        cover_query->source_id = source_id;
         cover_query->_size = sizeof(ddb_cover_query_t);
+        cover_query->user_data = new cover_req_t{.completions = completions, .id = id};
+        ddb_artwork->cover_get(cover_query, callback_cover_art_found);
+    };
 
-        auto creq = std::make_shared<cover_req_t>();
-        auto creq_copy = new std::shared_ptr(creq);
-        cover_query->user_data = creq_copy;
+    // Covers found by previous syncs
+    auto cover_cache = db->get_cover_cache();
+    if (!cover_cache) {
+        logger->warn("Could not read cached covers from the database.");
+    }
+    size_t n_cached = 0;
 
-        ddb_artwork->cover_get(cover_query, callback_cover_art_found);
-        std::unique_lock<std::mutex> lock(creq->m);
-        if (!creq->returned) {
-            creq->c.wait_for(lock, timeout, [&creq] { return creq->returned; });
+    auto cached_cover =
+        [&](const std::optional<cover_source_dir>& source_dir) -> std::optional<path> {
+            if (!cover_cache || !source_dir) {
+                return std::nullopt;
+            }
+            const auto entry = cover_cache->find(source_dir->dir.string());
+            if (entry == cover_cache->end() || entry->second.dir_mtime != source_dir->mtime) {
+                return std::nullopt;
+            }
+            std::error_code ec;
+            const auto image_mtime = last_write_time(entry->second.image_filename, ec);
+            if (ec || image_mtime != entry->second.image_mtime) {
+                return std::nullopt;
+            }
+            return entry->second.image_filename;
+        };
+
+    auto resolve = [&](const pending_req& req, const path& source) {
+        if (!dry) {
+            db->register_file(source);
+            for (const auto& plt_uuid : req.src.plt_uuids) {
+                db->register_file_in_playlist(source, plt_uuid);
+            }
         }
-        if (!creq->returned) {
-            plug_logger->debug(
-                "Cover request for {} timed out after {:%Q %q}", target_dir, timeout
+        path destination = req.target_dir / fname;
+        auto old = find_entry(snapshot, source);
+        auto old_dest = old ? std::optional{old->destination} : std::nullopt;
+
+        bool dest_newer;
+        try {
+            dest_newer = dests.is_newer(destination, source);
+        } catch (std::filesystem::filesystem_error& e) {
+            dest_newer = false;
+        }
+        bool old_newer;
+        try {
+            old_newer = old_dest && dests.is_newer(*old_dest, source);
+        } catch (std::filesystem::filesystem_error& e) {
+            old_newer = false;
+        }
+
+        if (dest_newer) {
+            logger->verbose("Cover at {} is newer than source {}", destination, source);
+        } else if (old_newer && *old_dest != destination) {
+            auto cover_job = std::make_unique<MoveJob>(
+                logger, db, sync_id, source, *old_dest, destination, ""
             );
-            creq->timed_out = true;
-        } else if (creq->cover == nullptr) {
-            plug_logger->debug("No cover found for {}", target_dir);
+            jobs->push_back(std::move(cover_job));
         } else {
-            path source = creq->cover->image_filename;
-            if (!dry) {
-                db->register_file(source);
-                for (const auto& plt_uuid : src.plt_uuids) {
-                    db->register_file_in_playlist(source, plt_uuid);
+            auto cover_job = std::make_unique<CopyJob>(
+                logger, db, sync_id, source, destination, get_copy_opts(conf)
+            );
+            jobs->push_back(std::move(cover_job));
+        }
+        if (queued_cb) {
+            queued_cb();
+        }
+    };
+
+    auto resolve_found = [&](const pending_req& req, ddb_cover_info_t* cover) {
+        if (cover == nullptr) {
+            plug_logger->debug("No cover found for {}", req.target_dir);
+            return;
+        }
+        path source = cover->image_filename;
+        cover_completions_t::release_cover(cover);
+        std::error_code ec;
+        const auto image_mtime = last_write_time(source, ec);
+        if (!dry && req.source_dir && !ec) {
+            db->register_cover(
+                req.source_dir->dir,
+                {
+                    .dir_mtime = req.source_dir->mtime,
+                    .image_filename = source,
+                    .image_mtime = image_mtime,
                 }
+            );
+        }
+        resolve(req, source);
+    };
+
+    auto next = items.begin();
+    size_t next_id = 0;
+    const auto stop = plugin.stop.get_token();
+    while (next != items.end() || !pending.empty()) {
+        while (next != items.end() && pending.size() + timed_out.size() < max_inflight &&
+               !stop.stop_requested())
+        {
+            const auto& [target_dir, src] = *next;
+            next++;
+            pending_req req{
+                .deadline = clock::now() + timeout,
+                .target_dir = target_dir,
+                .src = src,
+                .source_dir = get_cover_source_dir(src),
+            };
+            if (const auto cached = cached_cover(req.source_dir)) {
+                plug_logger->debug("Using cached cover {} for {}", *cached, target_dir);
+                n_cached++;
+                resolve(req, *cached);
+                continue;
             }
-            path destination = target_dir / fname;
-            auto old = db->find_entry(source);
-            auto old_dest = old ? std::optional{old->destination} : std::nullopt;
+            const auto id = next_id++;
+            pending.emplace(id, std::move(req));
+            request(id, src);
+        }
+        if (pending.empty() && next == items.end() && !stop.stop_requested()) {
+            continue;
+        }
 
-            bool dest_newer;
-            try {
-                dest_newer = is_newer(destination, source);
-            } catch (std::filesystem::filesystem_error& e) {
-                dest_newer = false;
+        // Unless cancelled, one of them is not empty, since we would have
+        // issued another request otherwise. We thus never wait unbounded.
+        auto deadline = clock::time_point::max();
+        for (const auto& [_, req] : pending) {
+            deadline = std::min(deadline, req.deadline);
+        }
+        for (const auto& [_, expiry] : timed_out) {
+            deadline = std::min(deadline, expiry);
+        }
+        decltype(completions->done) done;
+        {
+            std::unique_lock lock(completions->m);
+            completions->c.wait_until(lock, stop, deadline, [&completions] {
+                return !completions->done.empty();
+            });
+            done.swap(completions->done);
+        }
+        if (stop.stop_requested()) {
+            plug_logger->debug("Cancelled while queueing cover jobs");
+            for (auto [_, cover] : done) {
+                cover_completions_t::release_cover(cover);
             }
-            bool old_newer;
-            try {
-                old_newer = old_dest && is_newer(*old_dest, source);
-            } catch (std::filesystem::filesystem_error& e) {
-                old_newer = false;
+            if (ddb_artwork->cancel_queries_with_source_id != nullptr) {
+                ddb_artwork->cancel_queries_with_source_id(source_id);
             }
+            completions->close();
+            return false;
+        }
 
-            if (dest_newer) {
-                logger->verbose("Cover at {} is newer than source {}", destination, source);
-            } else if (old_newer && *old_dest != destination) {
-                auto cover_job = std::make_unique<MoveJob>(
-                    logger, db, sync_id, *old_dest, destination, source, ""
-                );
-                jobs->push_back(std::move(cover_job));
-            } else {
-                auto cover_job = std::make_unique<CopyJob>(
-                    logger, db, sync_id, creq->cover->image_filename, destination
-                );
-                jobs->push_back(std::move(cover_job));
-            }
-            if (queued_cb) {
-                queued_cb();
+        for (auto [id, cover] : done) {
+            const auto req = pending.find(id);
+            if (req == pending.end()) {
+                // Completed after timing out, possibly after its grace period
+                timed_out.erase(id);
+                cover_completions_t::release_cover(cover);
+                continue;
             }
+            resolve_found(req->second, cover);
+            pending.erase(req);
         }
+
+        const auto now = clock::now();
+        std::erase_if(pending, [&](const auto& entry) {
+            const auto& req = entry.second;
+            if (req.deadline > now) {
+                return false;
+            }
+            plug_logger->debug(
+                "Cover request for {} timed out after {:%Q %q}", req.target_dir, timeout
+            );
+            timed_out.emplace(entry.first, now + timeout);
+            return true;
+        });
+        std::erase_if(timed_out, [&](const auto& entry) { return entry.second <= now; });
     }
+    completions->close();
+    plug_logger->debug("Used {} cached covers, requested {}", n_cached, next_id);
     return true;
 }
 
@@ -344,19 +801,178 @@ bool should_convert(DB_playItem_t* it, const std::set<std::string>& sels) {
     }
 }
 
+// Recognizes sources that were synced before under another path, e.g. because
+// they were moved in the library, by the fingerprints of their contents, so
+// that their destinations can be moved rather than copied anew. Fingerprints
+// are persisted in the database and only recomputed when a source changed.
+// Safe to use from several threads.
+class RenameDetector {
+  public:
+    struct candidate_t {
+        path source;
+        path destination;
+        std::optional<std::string> converter_preset;
+    };
+
+    // unreferenced are the sources that are in none of the playlists anymore,
+    // and the destinations they were synced to
+    RenameDetector(
+        DatabaseHandle _db,
+        fingerprint_method _method,
+        const sync_snapshot_t& snapshot,
+        const DestinationIndex& dests,
+        const std::vector<std::tuple<path, path>>& unreferenced,
+        bool _read_only
+    ) :
+        db(_db), method(_method), read_only(_read_only) {
+        if (auto stored = db->get_content_fingerprints()) {
+            fingerprints = std::move(*stored);
+        }
+        for (const auto& [source, destination] : unreferenced) {
+            const auto fp = fingerprints.find(source.string());
+            const auto old = find_entry(snapshot, source);
+            if (fp == fingerprints.end() || fp->second.method != method || old == nullptr ||
+                !dests.exists(destination))
+            {
+                continue;
+            }
+            candidates.emplace(
+                fp->second.fingerprint,
+                candidate_t{
+                    .source = source,
+                    .destination = destination,
+                    .converter_preset = old->converter_preset,
+                }
+            );
+        }
+    }
+
+    // Returns the fingerprint of source, or nullopt if it can't be read
+    std::optional<content_fingerprint_t> fingerprint(const path& source) {
+        std::error_code ec;
+        const auto mtime = last_write_time(source, ec);
+        if (ec) {
+            return std::nullopt;
+        }
+        {
+            std::lock_guard lock(m);
+            const auto stored = fingerprints.find(source.string());
+            if (stored != fingerprints.end() && stored->second.mtime == mtime &&
+                stored->second.method == method)
+            {
+                return stored->second.fingerprint;
+            }
+        }
+        content_fingerprint_entry_t entry{.mtime = mtime, .method = method};
+        try {
+            entry.fingerprint = fingerprint_file(source, method);
+        } catch (std::filesystem::filesystem_error&) {
+            return std::nullopt;
+        }
+        if (!read_only) {
+            db->register_content_fingerprint(source, entry);
+        }
+        std::lock_guard lock(m);
+        fingerprints.insert_or_assign(source.string(), entry);
+        return entry.fingerprint;
+    }
+
+    // Claims the destination of an unreferenced source with the same contents
+    // as source that was synced with the same converter preset, if any
+    std::optional<candidate_t>
+    claim(const path& source, const std::optional<std::string>& converter_preset) {
+        const auto fp = fingerprint(source);
+        if (!fp) {
+            return std::nullopt;
+        }
+        std::lock_guard lock(m);
+        auto [begin, end] = candidates.equal_range(*fp);
+        for (auto c = begin; c != end; c++) {
+            if (c->second.converter_preset == converter_preset) {
+                auto out = std::move(c->second);
+                candidates.erase(c);
+                claimed_sources.insert(out.source.string());
+                return out;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Whether a source's destination was claimed, so that it must not be
+    // deleted
+    bool claimed(const path& old_source) {
+        std::lock_guard lock(m);
+        return claimed_sources.contains(old_source.string());
+    }
+
+  private:
+    struct fingerprint_hash {
+        size_t operator()(const content_fingerprint_t& fp) const { return fp.hash ^ fp.size; }
+    };
+
+    DatabaseHandle db;
+    const fingerprint_method method;
+    const bool read_only;
+    std::mutex m;
+    content_fingerprints_t fingerprints;
+    std::unordered_multimap<content_fingerprint_t, candidate_t, fingerprint_hash> candidates;
+    std::unordered_set<std::string> claimed_sources;
+};
+
+using job_list = std::vector<std::unique_ptr<Job>>;
+
+// Returns a job that moves the destination of an unreferenced source with the
+// same contents as source to destination, if there is one, claiming that
+// destination. Called in the order sources were gathered, so that which of
+// several sources with the same contents gets it doesn't depend on how the
+// planner threads were scheduled.
+std::unique_ptr<Job> make_rename_job(
+    const ddb_ows_config& conf,
+    DatabaseHandle db,
+    const sync_snapshot_t& snapshot,
+    RenameDetector& renames,
+    std::shared_ptr<Logger> logger,
+    DB_playItem_t* it,
+    sync_id_t sync_id,
+    const path& source,
+    const path& destination,
+    const std::optional<ddb_converter_settings_t>& conv_settings
+) {
+    const bool should_conv = should_convert(it, conf.conv_fts);
+    if (find_entry(snapshot, source) != nullptr || (should_conv && !conv_settings)) {
+        return nullptr;
+    }
+    const auto preset = should_conv ? std::make_optional<std::string>(
+                                          conv_settings->encoder_preset->title
+                                      )
+                                    : std::nullopt;
+    auto renamed = renames.claim(source, preset);
+    if (!renamed) {
+        return nullptr;
+    }
+    return std::make_unique<MoveJob>(
+        logger, db, sync_id, source, renamed->destination, destination, preset, renamed->source
+    );
+}
+
+// Adds the jobs that sync source to destination to out, except for moves of
+// renamed sources, see make_rename_job. The extension of destination is
+// replaced with conf.conv_ext if source is converted.
 void make_job(
     const ddb_ows_config& conf,
     DatabaseHandle db,
-    std::shared_ptr<JobsQueue> out,
+    const sync_snapshot_t& snapshot,
+    const DestinationIndex& dests,
+    job_list& out,
     std::shared_ptr<Logger> logger,
     DB_playItem_t* it,
     sync_id_t sync_id,
     path source,
-    path destination,
+    path& destination,
     const std::optional<ddb_converter_settings_t>& conv_settings
 ) {
     // throws: can throw any filesystem error throw by checking ctime
-    const auto old = db->find_entry(source);
+    const auto old = find_entry(snapshot, source);
     const std::optional<path> old_dest = old ? old->destination : std::nullopt;
 
     bool should_conv = should_convert(it, conf.conv_fts);
@@ -366,13 +982,13 @@ void make_job(
 
     bool dest_newer;
     try {
-        dest_newer = is_newer(destination, source);
+        dest_newer = dests.is_newer(destination, source);
     } catch (std::filesystem::filesystem_error& e) {
         dest_newer = false;
     }
     bool old_newer;
     try {
-        old_newer = old_dest && is_newer(*old_dest, source);
+        old_newer = old_dest && dests.is_newer(*old_dest, source);
     } catch (std::filesystem::filesystem_error& e) {
         old_newer = false;
     }
@@ -386,7 +1002,17 @@ void make_job(
         }
         std::string preset_title = conv_settings->encoder_preset->title;
         auto cjob = std::make_unique<ConvertJob>(
-            logger, db, ddb, *conv_settings, it, sync_id, source, destination
+            logger,
+            db,
+            ddb,
+            *conv_settings,
+            it,
+            sync_id,
+            source,
+            destination,
+            get_copy_opts(conf),
+            conf.scratch_dir,
+            plugin.transcode_cache
         );
         if (old && old->converter_preset == preset_title) {
             // This source file was synced previously and the same encoder
@@ -401,43 +1027,51 @@ void make_job(
             } else if (old_newer && old_dest != destination) {
                 // The source was previously converted with a different
                 // destination, which is newer than the source
-                out->emplace_back<MoveJob>(
+                out.push_back(std::make_unique<MoveJob>(
                     logger, db, sync_id, source, *old_dest, destination, old->converter_preset
-                );
+                ));
             } else {
                 // The source is newer => delete the old destination and
                 // reconvert with new destination
                 if (old_dest != destination) {
-                    out->emplace_back<DeleteJob>(logger, db, sync_id, source, *old_dest);
+                    out.push_back(
+                        std::make_unique<DeleteJob>(logger, db, sync_id, source, *old_dest)
+                    );
                 }
-                out->push_back(std::move(cjob));
+                out.push_back(std::move(cjob));
             }
         } else if (old) {
             // This source file was previously synced, but with a different
             // encoder. Convert it, and clean up the old file.
-            out->push_back(std::move(cjob));
-            out->emplace_back<DeleteJob>(logger, db, sync_id, source, *old_dest);
+            out.push_back(std::move(cjob));
+            out.push_back(std::make_unique<DeleteJob>(logger, db, sync_id, source, *old_dest));
         } else {
             // This source file was not previously synced. All we have to do is
             // convert it.
-            out->push_back(std::move(cjob));
+            out.push_back(std::move(cjob));
         }
-    } else if (old_dest && *old_dest != destination && exists(*old_dest)) {
+    } else if (old_dest && *old_dest != destination && dests.exists(*old_dest)) {
         // This source file was synced previously, and was not converted
         if (old_newer && !old->converter_preset) {
             // the destination file is newer than the source => move
-            out->emplace_back<MoveJob>(logger, db, sync_id, source, *old_dest, destination, "");
+            out.push_back(
+                std::make_unique<MoveJob>(logger, db, sync_id, source, *old_dest, destination, "")
+            );
         } else {
             // the source file is newer than the old copy, or was previously
             // converted but should not be now => delete the old copy/conversion
             // and copy anew
-            out->emplace_back<DeleteJob>(logger, db, sync_id, source, *old_dest);
-            out->emplace_back<CopyJob>(logger, db, sync_id, source, destination);
+            out.push_back(std::make_unique<DeleteJob>(logger, db, sync_id, source, *old_dest));
+            out.push_back(std::make_unique<CopyJob>(
+                logger, db, sync_id, source, destination, get_copy_opts(conf)
+            ));
         }
     } else if (dest_newer) {
         logger->verbose("Destination {} is newer than source {}; skipping.", destination, source);
     } else {
-        out->emplace_back<CopyJob>(logger, db, sync_id, source, destination);
+        out.push_back(std::make_unique<CopyJob>(
+            logger, db, sync_id, source, destination, get_copy_opts(conf)
+        ));
     }
 }
 
@@ -450,6 +1084,7 @@ std::string plt_get_title(ddb_playlist_t* plt) {
 
 bool save_playlist(
     const ddb_ows_config& conf,
+    OutputPathCache& output_paths,
     const char* ext,
     ddb_playlist_t* plt_in,
     std::shared_ptr<Logger> logger,
@@ -469,8 +1104,8 @@ bool save_playlist(
     int out = 0;
 
     const auto tf_str = conf.fn_formats[0];
-    tf_ptr fmt(ddb->tf_compile(tf_str.c_str()), ddb->tf_free);
-    if (fmt.get() == nullptr) {
+    const title_format fmt(tf_str);
+    if (fmt.bc == nullptr) {
         logger->err("Invalid title format string {}.", tf_str);
         return false;
     }
@@ -494,7 +1129,7 @@ bool save_playlist(
             DB_playItem_t* new_it = ddb->pl_item_alloc();
             ddb->pl_item_copy(new_it, its[k]);
             ddb->pl_item_unref(its[k]);
-            path out_path = get_output_path(new_it, fmt.get());
+            path out_path = output_paths.get(new_it, fmt);
 
             if (should_convert(new_it, conf.conv_fts)) {
                 out_path.replace_extension(conf.conv_ext);
@@ -529,6 +1164,7 @@ bool save_playlist(
 bool _save_playlists(
     bool dry,
     const ddb_ows_config& conf,
+    OutputPathCache& output_paths,
     const std::vector<ddb_playlist_t*>& playlists,
     const char* ext,
     std::shared_ptr<Logger> logger,
@@ -537,7 +1173,7 @@ bool _save_playlists(
     // returns true if all playlists were successfully saved
     bool out = true;
     for (ddb_playlist_t* plt : playlists) {
-        bool saved = save_playlist(conf, ext, plt, logger, dry);
+        bool saved = save_playlist(conf, output_paths, ext, plt, logger, dry);
         out = out && saved;
     }
     return out;
@@ -546,16 +1182,19 @@ bool _save_playlists(
 bool save_playlists(
     bool dry,
     const ddb_ows_config& conf,
+    OutputPathCache& output_paths,
     const std::vector<ddb_playlist_t*>& playlists,
     std::shared_ptr<Logger> logger,
     playlist_save_cb_t callback
 ) {
     bool out = true;
     if (conf.sync_pls.dbpl) {
-        out = out && _save_playlists(dry, conf, playlists, "dbpl", logger, callback);
+        out = out &&
+              _save_playlists(dry, conf, output_paths, playlists, "dbpl", logger, callback);
     }
     if (conf.sync_pls.m3u8) {
-        out = out && _save_playlists(dry, conf, playlists, "m3u8", logger, callback);
+        out = out &&
+              _save_playlists(dry, conf, output_paths, playlists, "m3u8", logger, callback);
     }
     return out;
 }
@@ -592,18 +1231,144 @@ void build_conv_ext_cache(const std::set<std::string>& sels) {
 struct job_source {
     std::shared_ptr<ddb_playItem_t> it;
     const std::string_view plt_uuid;
+    // Index into the list of unique sources
+    size_t unique_idx;
+};
+
+// A unique source file and the jobs planned for it
+struct planned_source {
+    std::shared_ptr<ddb_playItem_t> it;
+    path source;
+    path destination;
+    job_list jobs;
+};
+
+// Planner threads claim this many sources at a time
+constexpr size_t PLAN_CHUNK_SIZE = 64;
+
+unsigned int get_plan_wts(const ddb_ows_config& conf) {
+    if (conf.plan_wts > 0) {
+        return conf.plan_wts;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls plan on every element of items, split into chunks across n_threads
+// threads. publish is called in the calling thread for every chunk, in order,
+// as soon as that chunk and all chunks before it are planned. Thus the output
+// is deterministic regardless of how the threads are scheduled.
+// Returns false if cancelled, true if successful
+template <typename T>
+bool plan_parallel(
+    std::vector<T>& items,
+    unsigned int n_threads,
+    std::function<void(T&)> plan,
+    std::function<void(std::span<T>)> publish
+) {
+    const size_t n_chunks = (items.size() + PLAN_CHUNK_SIZE - 1) / PLAN_CHUNK_SIZE;
+    auto chunk = [&items](size_t k) {
+        const size_t begin = k * PLAN_CHUNK_SIZE;
+        const size_t end = std::min(begin + PLAN_CHUNK_SIZE, items.size());
+        return std::span<T>(items.begin() + begin, items.begin() + end);
+    };
+
+    std::mutex m;
+    std::condition_variable_any chunk_done;
+    std::vector<bool> done(n_chunks, false);
+    std::atomic<size_t> next_chunk = 0;
+    auto stop = plugin.stop.get_token();
+
+    auto worker = [&]() {
+        size_t k;
+        while (!stop.stop_requested() && (k = next_chunk++) < n_chunks) {
+            for (auto& item : chunk(k)) {
+                if (stop.stop_requested()) {
+                    break;
+                }
+                plan(item);
+            }
+            {
+                std::lock_guard lock(m);
+                done[k] = true;
+            }
+            chunk_done.notify_all();
+        }
+    };
+
+    std::vector<std::jthread> workers;
+    n_threads = std::min<size_t>(n_threads, n_chunks);
+    workers.reserve(n_threads);
+    for (unsigned int i = 0; i < n_threads; i++) {
+        workers.emplace_back(worker);
+    }
+
+    for (size_t k = 0; k < n_chunks; k++) {
+        {
+            std::unique_lock lock(m);
+            if (!chunk_done.wait(lock, stop, [&done, k] { return done[k]; })) {
+                return false;
+            }
+        }
+        publish(chunk(k));
+    }
+    // jthreads auto-join when the vector destructs
+    return !stop.stop_requested();
+}
+
+// What is recorded about a sync in its history once it is done. Filled in by
+// queue_jobs and run.
+struct sync_record_t {
+    // Unset for dry runs
+    std::optional<sync_id_t> sync_id;
+    sync_phases_t phases;
 };
 
+std::chrono::milliseconds elapsed_since(std::chrono::steady_clock::time_point start) {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now() - start);
+}
+
+// Removes the staging files and progress records in dests whose destination
+// isn't in synced. Those of destinations that are synced again are kept for
+// their copy to resume from.
+void remove_stale_staging(
+    bool dry,
+    std::shared_ptr<Logger> logger,
+    const DestinationIndex& dests,
+    const std::set<path>& synced
+) {
+    for (const auto& file : dests.staged()) {
+        if (synced.contains(*staged_destination(file))) {
+            continue;
+        }
+        if (dry) {
+            logger->log("Would remove leftover {}.", file);
+            continue;
+        }
+        std::error_code e;
+        if (!std::filesystem::remove(file, e) && e) {
+            logger->warn("Could not remove leftover {}: {}", file, e.message());
+            continue;
+        }
+        plugin.logger->debug("Removed leftover {}", file);
+        clean_parents(file.parent_path());
+    }
+}
+
 // Returns false if cancelled, true if successful
 bool queue_jobs(
     bool dry,
     const ddb_ows_config& conf,
+    DatabaseHandle db,
+    OutputPathCache& output_paths,
     const std::vector<ddb_playlist_t*>& playlists,
     std::shared_ptr<Logger> logger,
+    sync_record_t& record,
     sources_gathered_cb_t gathered_cb,
     job_queued_cb_t queued_cb,
     queueing_complete_cb_t complete_cb
 ) {
+    auto phase_start = std::chrono::steady_clock::now();
     auto jobs = plugin.jobs;
     if (!jobs->empty()) {
         // To avoid double-queueing
@@ -614,7 +1379,6 @@ bool queue_jobs(
     auto plug_logger = ddb_ows->logger;
 
     path root(conf.root);
-    DatabaseHandle db = std::make_shared<Database>(root);
 
     const auto tf_str = conf.fn_formats[0];
     const auto cover_sync = conf.cover_sync;
@@ -629,12 +1393,29 @@ bool queue_jobs(
         logger->err("Could not create a new sync in the database.");
         return false;
     }
-    tf_ptr fmt(ddb->tf_compile(tf_str.c_str()), ddb->tf_free);
-    if (fmt.get() == nullptr) {
+    if (!dry) {
+        record.sync_id = sync_id;
+    }
+    const auto snapshot = db->get_snapshot();
+    if (!snapshot) {
+        logger->err("Could not read previous syncs from the database.");
+        return false;
+    }
+    const DestinationIndex dests(root, std::max(1, conf.scan_wts));
+    plug_logger->debug(
+        "Indexed {} files in {}{}",
+        dests.size(),
+        root,
+        dests.case_insensitive() ? " (case-insensitive)" : ""
+    );
+    for (const auto& dir : dests.errors()) {
+        logger->warn("Could not scan destination directory {}", dir);
+    }
+    const title_format fmt(tf_str);
+    if (fmt.bc == nullptr) {
         logger->err("Invalid title format string {}.", tf_str);
         return false;
     }
-    jobs->open();
 
     // We need to lock the playlist to avoid data races as we're looping over
     // it, but cover requests run async in another thread and ALSO need to lock
@@ -655,7 +1436,7 @@ bool queue_jobs(
         const auto plt_title = plt_get_title(plt);
         plug_logger->debug("Looking for jobs from playlist {}", plt_title);
 
-        const auto plt_uuid = plt_uuids.emplace_back(_plt_get_uuid(plt).str());
+        const auto& plt_uuid = plt_uuids.emplace_back(_plt_get_uuid(plt).str());
         if (!dry) {
             db->register_playlist(plt_uuid, plt_title);
             db->clear_playlist(plt_uuid);
@@ -666,7 +1447,7 @@ bool queue_jobs(
         it = ddb->plt_get_first(plt, PL_MAIN);
         while (it != nullptr) {
             auto p = std::shared_ptr<DB_playItem_t>(it, ddb->pl_item_unref);
-            sources.push_back({.it = p, .plt_uuid = plt_uuid});
+            sources.push_back({.it = p, .plt_uuid = plt_uuid, .unique_idx = 0});
             it = ddb->pl_get_next(it, PL_MAIN);
         }
     }
@@ -675,61 +1456,134 @@ bool queue_jobs(
         gathered_cb(sources.size());
     }
 
-    std::set<std::string> visited_sources{};
-
-    const bool artwork_available = ddb_artwork != nullptr;
-
-    for (const auto& job_source : sources) {
-        // Items will be unref'd when sources goes out of scope
-        if (ddb_ows->stop.stop_requested()) {
-            break;
-        }
+    // Deduplicate sources and do the database bookkeeping up front, so that
+    // only the expensive part of planning runs in parallel.
+    std::vector<planned_source> unique_sources;
+    std::unordered_map<std::string, size_t> visited_sources{};
 
+    for (auto& job_source : sources) {
         auto it = job_source.it.get();
         path source = std::string(ddb->pl_find_meta(it, ":URI"));
-        path destination = root / get_output_path(it, fmt.get());
-        path target_dir = destination.parent_path();
+        const auto [visited, inserted] =
+            visited_sources.try_emplace(source, unique_sources.size());
+        if (inserted) {
+            unique_sources.push_back({.it = job_source.it, .source = source, .jobs = {}});
+        }
+        job_source.unique_idx = visited->second;
 
         if (!dry) {
-            if (!visited_sources.contains(source)) {
+            if (inserted) {
                 db->register_file(source);
             }
             db->register_file_in_playlist(source, job_source.plt_uuid);
         }
+    }
+    record.phases.gather = elapsed_since(phase_start);
+    phase_start = std::chrono::steady_clock::now();
+
+    std::optional<RenameDetector> renames;
+    if (conf.rename_detection == "sampled" || conf.rename_detection == "full") {
+        const auto unreferenced = db->get_unreferenced_files();
+        renames.emplace(
+            db,
+            conf.rename_detection == "full" ? fingerprint_method::full
+                                            : fingerprint_method::sampled,
+            *snapshot,
+            dests,
+            unreferenced.value_or(std::vector<std::tuple<path, path>>{}),
+            dry
+        );
+    }
 
-        if (cover_sync) {
-            auto [src, inserted] =
-                cover_its.insert({target_dir, {.it = job_source.it, .plt_uuids = {}}});
-            if (artwork_available) {
-                if (inserted) {
-                    plug_logger->debug("Copying cover to {}", target_dir);
-                    if (gathered_cb) {
-                        gathered_cb(sources.size() + cover_its.size());
-                    }
-                }
-                src->second.plt_uuids.emplace(job_source.plt_uuid);
-            } else if (inserted) {
-                logger->warn(
-                    "Would sync cover to directory {}, but artwork plugin is not available.",
-                    target_dir
-                );
-            }
-        }
-
-        if (const auto [_, inserted] = visited_sources.insert(source); !inserted) {
-            continue;
-        }
+    auto plan = [&](planned_source& p) {
+        // Items will be unref'd when sources goes out of scope
+        auto it = p.it.get();
+        p.destination = root / output_paths.get(it, fmt);
 
         try {
-            make_job(conf, db, jobs, logger, it, *sync_id, source, destination, conv_settings);
+            make_job(
+                conf,
+                db,
+                *snapshot,
+                dests,
+                p.jobs,
+                logger,
+                it,
+                *sync_id,
+                p.source,
+                p.destination,
+                conv_settings
+            );
+            if (renames) {
+                // Keep the fingerprints of all synced sources up to date, for
+                // when they are moved later. This also computes them ahead of
+                // publish, which claims renamed sources' destinations.
+                renames->fingerprint(p.source);
+            }
         } catch (std::filesystem::filesystem_error& e) {
-            logger->err("Could not queue job for {}: {}", source, e.what());
-            continue;
+            logger->err("Could not queue job for {}: {}", p.source, e.what());
+            return;
         }
 
         if (queued_cb) {
             queued_cb();
         }
+    };
+    auto publish = [&](std::span<planned_source> chunk) {
+        for (auto& p : chunk) {
+            if (renames && !p.destination.empty()) {
+                if (auto move = make_rename_job(
+                        conf,
+                        db,
+                        *snapshot,
+                        *renames,
+                        logger,
+                        p.it.get(),
+                        *sync_id,
+                        p.source,
+                        p.destination,
+                        conv_settings
+                    ))
+                {
+                    // Replaces copying or converting the source anew
+                    p.jobs.clear();
+                    p.jobs.push_back(std::move(move));
+                }
+            }
+            for (auto& job : p.jobs) {
+                jobs->push_back(std::move(job));
+            }
+        }
+    };
+    const auto n_plan_wts = get_plan_wts(conf);
+    plug_logger->debug("Planning {} sources using {} threads", unique_sources.size(), n_plan_wts);
+    plan_parallel<planned_source>(unique_sources, n_plan_wts, plan, publish);
+    record.phases.plan = elapsed_since(phase_start);
+    phase_start = std::chrono::steady_clock::now();
+
+    const bool artwork_available = ddb_artwork != nullptr;
+
+    for (const auto& job_source : sources) {
+        if (!cover_sync || ddb_ows->stop.stop_requested()) {
+            break;
+        }
+        path target_dir = unique_sources[job_source.unique_idx].destination.parent_path();
+        auto [src, inserted] =
+            cover_its.insert({target_dir, {.it = job_source.it, .plt_uuids = {}}});
+        if (artwork_available) {
+            if (inserted) {
+                plug_logger->debug("Copying cover to {}", target_dir);
+                if (gathered_cb) {
+                    gathered_cb(sources.size() + cover_its.size());
+                }
+            }
+            src->second.plt_uuids.emplace(job_source.plt_uuid);
+        } else if (inserted) {
+            logger->warn(
+                "Would sync cover to directory {}, but artwork plugin is not available.",
+                target_dir
+            );
+        }
     }
 
     if (ddb_ows->stop.stop_requested()) {
@@ -739,13 +1593,34 @@ bool queue_jobs(
 
     // Now we can dispatch cover requests
     if (artwork_available &&
-        !queue_cover_jobs(dry, conf, logger, db, *sync_id, cover_its, queued_cb))
+        !queue_cover_jobs(
+            dry, conf, logger, db, *snapshot, dests, *sync_id, cover_its, queued_cb
+        ))
     {
         return false;
     }
+    record.phases.cover = elapsed_since(phase_start);
+    phase_start = std::chrono::steady_clock::now();
+
+    // Every job queued above writes to one of these, so that leftovers that
+    // jobs may already be resuming in streaming mode are kept
+    std::set<path> synced;
+    for (const auto& p : unique_sources) {
+        synced.insert(p.destination);
+    }
+    for (const auto& [target_dir, _] : cover_its) {
+        synced.insert(target_dir / cover_fname);
+    }
+    remove_stale_staging(dry, logger, dests, synced);
 
     if (rm_unref) {
-        const auto unrefd = db->get_unreferenced_files();
+        auto unrefd = db->get_unreferenced_files();
+        if (unrefd && renames) {
+            // Their destinations now belong to the sources that replaced them
+            std::erase_if(*unrefd, [&](const auto& file) {
+                return renames->claimed(std::get<0>(file));
+            });
+        }
         if (unrefd) {
             if (gathered_cb) {
                 gathered_cb(sources.size() + cover_its.size() + unrefd->size());
@@ -759,8 +1634,13 @@ bool queue_jobs(
         }
     }
 
+    record.phases.plan += elapsed_since(phase_start);
+
+    // Everything registered while planning is committed before execution
+    db->flush();
     jobs->close();
-    const size_t n_jobs = jobs->size();
+    // In streaming mode some jobs may already have been popped
+    const size_t n_jobs = jobs->total();
     if (complete_cb) {
         complete_cb(n_jobs);
     }
@@ -768,30 +1648,219 @@ bool queue_jobs(
     return true;
 }
 
-bool worker_thread(bool dry, job_finished_cb_t callback) {
+// From linux/ioprio.h, which is not available everywhere
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+constexpr int IOPRIO_CLASS_BE = 2;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+
+// Lowers the CPU and I/O priority of the calling thread, so that syncs don't
+// disturb playback or the desktop
+void lower_thread_priority(const ddb_ows_config& conf) {
+    // Both apply to single threads when given a thread ID
+    const pid_t tid = syscall(SYS_gettid);
+    if (conf.worker_nice != 0 && setpriority(PRIO_PROCESS, tid, conf.worker_nice) != 0) {
+        plugin.logger->debug("Could not set niceness of worker: {}", strerror(errno));
+    }
+    int io_class;
+    if (conf.worker_io_class == "idle") {
+        io_class = IOPRIO_CLASS_IDLE;
+    } else if (conf.worker_io_class == "best-effort") {
+        io_class = IOPRIO_CLASS_BE;
+    } else {
+        return;
+    }
+    // The lowest priority within the class; ignored for idle
+    const int ioprio = io_class << IOPRIO_CLASS_SHIFT | 7;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio) != 0) {
+        plugin.logger->debug("Could not set I/O priority of worker: {}", strerror(errno));
+    }
+}
+
+// Upper bound of the I/O workers with conf.adaptive_wts. Copies already keep
+// many requests in flight each, so more rarely help even fast devices.
+constexpr unsigned int MAX_ADAPTIVE_IO_WTS = 8;
+constexpr std::chrono::milliseconds ADAPTIVE_WTS_INTERVAL{2000};
+
+bool worker_thread(
+    bool dry, const ddb_ows_config& conf, job_lane lane, job_finished_cb_t callback
+) {
+    lower_thread_priority(conf);
     std::unique_ptr<Job> job;
-    while ((job = plugin.jobs->pop())) {
+    while ((job = plugin.jobs->pop(lane))) {
         // unique_ptr is falsey if there is no object
-        bool status = job->run(dry);
-        if (callback) {
+        bool status = plugin.jobs->run(*job, dry);
+        auto next = status ? job->continuation() : nullptr;
+        if (next) {
+            // The job is only finished once its continuation is
+            plugin.jobs->push_continuation(std::move(next));
+        } else if (callback) {
             // callback is falsy if the function object is empty
             callback(std::move(job), status);
         }
+        plugin.jobs->done(lane);
     }
     return true;
 }
 
-bool execute(bool dry, const ddb_ows_config& conf, job_finished_cb_t callback) {
-    int n_wts = conf.conv_wts;
+// Adjusts the worker limits every interval until the queue is drained, then
+// logs the limits that were chosen
+void concurrency_thread(
+    std::array<lane_bounds_t, N_JOB_LANES> bounds, std::shared_ptr<Logger> logger
+) {
+    ConcurrencyController controller(plugin.jobs, bounds);
+    while (!plugin.jobs->wait_drained(ADAPTIVE_WTS_INTERVAL)) {
+        controller.adjust();
+    }
+    const auto cpu = controller.summary(job_lane::cpu);
+    const auto io = controller.summary(job_lane::io);
+    logger->log(
+        "Ran {:.1f} conversions at once on average ({} to {}, {} at the end) and {:.1f} "
+        "I/O jobs ({} to {}, {} at the end).",
+        cpu.mean,
+        cpu.min,
+        cpu.max,
+        cpu.last,
+        io.mean,
+        io.min,
+        io.max,
+        io.last
+    );
+}
+
+// Starts conf.conv_wts workers for conversions and conf.io_wts workers for
+// jobs that mostly write to the destination, so that encoding and writing
+// overlap without too many concurrent writes to the device. With
+// conf.adaptive_wts, those are only the initial limits: more workers are
+// started, and a ConcurrencyController tunes how many of them may run jobs.
+std::vector<std::jthread> start_workers(
+    bool dry, const ddb_ows_config& conf, std::shared_ptr<Logger> logger, job_finished_cb_t callback
+) {
+    std::array<lane_bounds_t, N_JOB_LANES> bounds;
+    auto& cpu = bounds[static_cast<size_t>(job_lane::cpu)];
+    auto& io = bounds[static_cast<size_t>(job_lane::io)];
+    cpu.min = cpu.initial = cpu.max = std::max(1, conf.conv_wts);
+    io.min = io.initial = io.max = std::max(1, conf.io_wts);
+    if (conf.adaptive_wts) {
+        cpu.min = io.min = 1;
+        cpu.max = std::max(cpu.initial, std::thread::hardware_concurrency());
+        io.max = std::max(io.initial, MAX_ADAPTIVE_IO_WTS);
+    }
+    plugin.jobs->set_limit(job_lane::cpu, cpu.initial);
+    plugin.jobs->set_limit(job_lane::io, io.initial);
     std::vector<std::jthread> workers;
-    workers.reserve(n_wts);
-    for (int i = 0; i < n_wts; i++) {
-        workers.emplace_back(worker_thread, dry, callback);
+    workers.reserve(cpu.max + io.max + 1);
+    for (unsigned int i = 0; i < cpu.max; i++) {
+        workers.emplace_back(worker_thread, dry, std::cref(conf), job_lane::cpu, callback);
     }
+    for (unsigned int i = 0; i < io.max; i++) {
+        workers.emplace_back(worker_thread, dry, std::cref(conf), job_lane::io, callback);
+    }
+    if (conf.adaptive_wts) {
+        workers.emplace_back(concurrency_thread, bounds, logger);
+    }
+    return workers;
+}
+
+bool execute(
+    bool dry, const ddb_ows_config& conf, std::shared_ptr<Logger> logger, job_finished_cb_t callback
+) {
+    auto workers = start_workers(dry, conf, logger, callback);
     // jthreads auto-join when the vector destructs
     return true;
 }
 
+// Writes back everything written to the destination's filesystem, which
+// includes the database, with a single syncfs
+void sync_destination(const path& root, std::shared_ptr<Logger> logger) {
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) != 0) {
+        logger->warn("Could not write back data to {}: {}", root, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    close(fd);
+    const auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+    logger->log(
+        "Wrote back all data to {} in {:%Q %q}. The device can now be removed safely.",
+        root,
+        elapsed
+    );
+}
+
+// Logs the totals of the jobs of sync_id, and the kinds of jobs that took
+// longest
+void log_sync_summary(Database& db, sync_id_t sync_id, std::shared_ptr<Logger> logger) {
+    constexpr double MiB = 1024 * 1024;
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+    const auto summaries = db.get_sync_summaries(1);
+    if (!summaries || summaries->empty() || summaries->front().sync_id != sync_id) {
+        return;
+    }
+    const auto& sync = summaries->front();
+    logger->verbose(
+        "Ran {} jobs ({} failed), which read {:.1f} MiB and wrote {:.1f} MiB in {:%Q %q} "
+        "({:.1f} MiB/s).",
+        sync.n_jobs,
+        sync.n_failed,
+        sync.bytes_read / MiB,
+        sync.bytes_written / MiB,
+        sync.phases ? sync.phases->execute : milliseconds(0),
+        sync.throughput() / MiB
+    );
+    const auto jobs = db.get_job_summaries(sync_id);
+    if (!jobs) {
+        return;
+    }
+    for (const auto& job : *jobs) {
+        logger->verbose(
+            "{} {}: {} jobs took {:%Q %q} in total, at most {:%Q %q}, and wrote {:.1f} MiB.",
+            job.kind,
+            job.strategy.empty() ? "-" : job.strategy,
+            job.n_jobs,
+            duration_cast<milliseconds>(job.job_time),
+            duration_cast<milliseconds>(job.max_job_time),
+            job.bytes_written / MiB
+        );
+    }
+}
+
+// Plans and executes concurrently: workers pop jobs as soon as the planner
+// publishes them, and exit once the queue is closed and drained.
+bool queue_and_execute(
+    bool dry,
+    const ddb_ows_config& conf,
+    DatabaseHandle db,
+    OutputPathCache& output_paths,
+    const std::vector<ddb_playlist_t*>& playlists,
+    std::shared_ptr<Logger> logger,
+    sync_record_t& record,
+    callback_t callbacks
+) {
+    plugin.jobs->open();
+    auto workers = start_workers(dry, conf, logger, callbacks.on_job_finished);
+    bool result = queue_jobs(
+        dry,
+        conf,
+        db,
+        output_paths,
+        playlists,
+        logger,
+        record,
+        callbacks.on_sources_gathered,
+        callbacks.on_job_queued,
+        callbacks.on_queueing_complete
+    );
+    // queue_jobs leaves the queue open if it bails out early
+    plugin.jobs->close();
+    return result;
+}
+
 bool run(
     bool dry,
     const std::vector<ddb_playlist_t*>& playlists,
@@ -810,17 +1879,81 @@ bool run(
     }
 
     const ddb_ows_config conf = plugin.pub.conf->get();
-    bool result = save_playlists(dry, conf, playlists, logger, callbacks.on_playlist_save) &&
-                  queue_jobs(
-                      dry,
-                      conf,
-                      playlists,
-                      logger,
-                      callbacks.on_sources_gathered,
-                      callbacks.on_job_queued,
-                      callbacks.on_queueing_complete
-                  ) &&
-                  execute(dry, conf, callbacks.on_job_finished);
+    plugin.jobs->set_order(
+        job_lane::cpu, conf.conv_order == "fifo" ? job_order::fifo : job_order::longest_first
+    );
+    plugin.jobs->set_scratch_limits(
+        conf.scratch_max_files > 0 ? conf.scratch_max_files : SIZE_MAX,
+        conf.scratch_max_mb > 0 ? uintmax_t(conf.scratch_max_mb) << 20 : UINTMAX_MAX
+    );
+    plugin.limiter->set_limits(uintmax_t(conf.io_limit_mbps) << 20, conf.io_limit_iops);
+    const bool deferred_sync = conf.durability == "deferred";
+    plugin.write_budget = deferred_sync && conf.dirty_budget_mb > 0
+                              ? std::make_shared<WriteBudget>(uintmax_t(conf.dirty_budget_mb) << 20)
+                              : nullptr;
+    plugin.transcode_cache =
+        conf.transcode_cache_dir.empty()
+            ? nullptr
+            : std::make_shared<TranscodeCache>(
+                  path(conf.transcode_cache_dir), uintmax_t(conf.transcode_cache_mb) << 20
+              );
+    DatabaseHandle db;
+    try {
+        db = std::make_shared<Database>(path(conf.root), conf.db_opts);
+    } catch (std::runtime_error& e) {
+        logger->err("Could not open database: {}", e.what());
+    }
+
+    std::unique_ptr<OutputPathCache> output_paths;
+    if (db) {
+        output_paths = std::make_unique<OutputPathCache>(db, conf.fn_formats[0], dry);
+    }
+
+    sync_record_t record;
+    auto phase_start = std::chrono::steady_clock::now();
+    bool result =
+        db &&
+        save_playlists(dry, conf, *output_paths, playlists, logger, callbacks.on_playlist_save);
+    record.phases.save_playlists = elapsed_since(phase_start);
+    if (result && conf.stream_jobs) {
+        phase_start = std::chrono::steady_clock::now();
+        result = queue_and_execute(
+            dry, conf, db, *output_paths, playlists, logger, record, callbacks
+        );
+        // Includes the other phases, which overlap with execution
+        record.phases.execute = elapsed_since(phase_start);
+    } else {
+        plugin.jobs->open();
+        result = result && queue_jobs(
+                               dry,
+                               conf,
+                               db,
+                               *output_paths,
+                               playlists,
+                               logger,
+                               record,
+                               callbacks.on_sources_gathered,
+                               callbacks.on_job_queued,
+                               callbacks.on_queueing_complete
+                           );
+        phase_start = std::chrono::steady_clock::now();
+        result = result && execute(dry, conf, logger, callbacks.on_job_finished);
+        record.phases.execute = elapsed_since(phase_start);
+    }
+    if (result && record.sync_id && !ddb_ows->stop.stop_requested()) {
+        db->register_sync_phases(*record.sync_id, record.phases);
+        log_sync_summary(*db, *record.sync_id, logger);
+    }
+    if (db) {
+        // Commit whatever the workers registered, also if we were cancelled
+        db->checkpoint();
+    }
+    // Close the database so that it is synced along with everything else
+    output_paths.reset();
+    db.reset();
+    if (deferred_sync && !dry) {
+        sync_destination(conf.root, logger);
+    }
 
     {
         std::lock_guard lock(ddb_ows->running_m);
@@ -830,6 +1963,10 @@ bool run(
     return result;
 }
 
+void set_io_limits(uintmax_t bytes_per_sec, unsigned int ops_per_sec) {
+    plugin.limiter->set_limits(bytes_per_sec, ops_per_sec);
+}
+
 bool cancel(cancel_cb_t callback) {
     auto* ddb_ows = reinterpret_cast<ddb_ows_plugin_int*>(ddb->plug_get_for_id("ddb_ows"));
     ddb_ows->logger->debug("Cancelling");
@@ -847,6 +1984,7 @@ void init(DB_functions_t* api) {
     plugin.logger->set_pattern("[%n] [%^%l%$] [thread %t] %v");
 
     plugin.jobs = std::make_shared<JobsQueue>();
+    plugin.limiter = std::make_shared<IoLimiter>();
 
     plugin.pub.conf = std::make_shared<Configuration>(api);
     plugin.pub.conf->load_conf();
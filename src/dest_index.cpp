@@ -0,0 +1,266 @@
+#include "dest_index.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <string_view>
+#include <thread>
+
+#include "copy_engine.hpp"
+
+namespace ddb_ows {
+
+namespace {
+
+// glibc doesn't declare this, since it wraps getdents64 in readdir
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#ifndef EXFAT_SUPER_MAGIC
+#define EXFAT_SUPER_MAGIC 0x2011BAB0
+#endif
+
+constexpr size_t DIRENT_BUF_SIZE = 32 * 1024;
+// Symbolic links to directories are followed like any other path to the files
+// below them would be
+constexpr int DIR_FLAGS = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+bool stat_at(int dirfd, const char* name, struct statx& stx, bool follow = false) {
+    return statx(
+               dirfd,
+               name,
+               (follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_NO_AUTOMOUNT,
+               STATX_TYPE | STATX_MTIME | STATX_SIZE | STATX_INO,
+               &stx
+           ) == 0;
+}
+
+dest_entry_t to_entry(const struct statx& stx) {
+    using namespace std::chrono;
+    const auto mtime = sys_time<nanoseconds>(
+        seconds(stx.stx_mtime.tv_sec) + nanoseconds(stx.stx_mtime.tv_nsec)
+    );
+    return {
+        .mtime = time_point_cast<std::filesystem::file_time_type::duration>(
+            file_clock::from_sys(mtime)
+        ),
+        .size = stx.stx_size,
+        .dev = makedev(stx.stx_dev_major, stx.stx_dev_minor),
+        .ino = stx.stx_ino,
+    };
+}
+
+}  // namespace
+
+DestinationIndex::DestinationIndex(const path& _root, unsigned int n_threads) :
+    root(_root.lexically_normal()) {
+    struct statfs fs;
+    if (statfs(root.c_str(), &fs) == 0) {
+        fold_case = fs.f_type == MSDOS_SUPER_MAGIC || fs.f_type == EXFAT_SUPER_MAGIC;
+    }
+
+    int fd = open(root.c_str(), DIR_FLAGS);
+    if (fd < 0) {
+        // A root that doesn't exist yet is simply empty
+        if (errno != ENOENT) {
+            scan_errors.push_back(root);
+        }
+        return;
+    }
+    struct stat root_st;
+    if (fstat(fd, &root_st) != 0) {
+        scan_errors.push_back(root);
+        close(fd);
+        return;
+    }
+    const dir_id_t root_id{root_st.st_dev, root_st.st_ino};
+    std::vector<std::string> subdirs;
+    std::vector<dir_id_t> ancestors;
+    scan(
+        fd, "", entries, scan_errors, staged_files, ancestors, n_threads > 1 ? &subdirs : nullptr
+    );
+    if (subdirs.empty()) {
+        return;
+    }
+
+    n_threads = std::min<size_t>(n_threads, subdirs.size());
+    std::vector<entry_map> thread_entries(n_threads);
+    std::vector<std::vector<path>> thread_errors(n_threads);
+    std::vector<std::vector<path>> thread_staged(n_threads);
+    std::atomic<size_t> next = 0;
+    {
+        std::vector<std::jthread> threads;
+        for (unsigned int i = 0; i < n_threads; i++) {
+            threads.emplace_back([&, i] {
+                std::vector<dir_id_t> thread_ancestors{root_id};
+                for (size_t j = next++; j < subdirs.size(); j = next++) {
+                    const auto dir = root / subdirs[j];
+                    int dir_fd = open(dir.c_str(), DIR_FLAGS);
+                    if (dir_fd < 0) {
+                        thread_errors[i].push_back(dir);
+                        continue;
+                    }
+                    scan(
+                        dir_fd,
+                        subdirs[j],
+                        thread_entries[i],
+                        thread_errors[i],
+                        thread_staged[i],
+                        thread_ancestors,
+                        nullptr
+                    );
+                }
+            });
+        }
+    }
+    for (unsigned int i = 0; i < n_threads; i++) {
+        entries.merge(thread_entries[i]);
+        scan_errors.insert(scan_errors.end(), thread_errors[i].begin(), thread_errors[i].end());
+        staged_files.insert(
+            staged_files.end(), thread_staged[i].begin(), thread_staged[i].end()
+        );
+    }
+}
+
+std::string DestinationIndex::key(std::string relative) const {
+    if (fold_case) {
+        // FAT folds non-ASCII characters according to its codepage, exFAT
+        // according to an upcase table. ASCII covers the common case.
+        std::transform(relative.begin(), relative.end(), relative.begin(), [](unsigned char c) {
+            return c < 0x80 ? std::tolower(c) : c;
+        });
+    }
+    return relative;
+}
+
+void DestinationIndex::scan(
+    int dirfd,
+    const std::string& prefix,
+    entry_map& out,
+    std::vector<path>& errors,
+    std::vector<path>& staged,
+    std::vector<dir_id_t>& ancestors,
+    std::vector<std::string>* subdirs
+) const {
+    struct stat dir_st;
+    if (fstat(dirfd, &dir_st) != 0) {
+        errors.push_back(root / prefix);
+        close(dirfd);
+        return;
+    }
+    const dir_id_t id{dir_st.st_dev, dir_st.st_ino};
+    if (std::find(ancestors.begin(), ancestors.end(), id) != ancestors.end()) {
+        // A symbolic link to a directory we are already in
+        close(dirfd);
+        return;
+    }
+    ancestors.push_back(id);
+    std::vector<std::string> children;
+    {
+        std::vector<char> buf(DIRENT_BUF_SIZE);
+        while (true) {
+            const long n = syscall(SYS_getdents64, dirfd, buf.data(), buf.size());
+            if (n < 0) {
+                errors.push_back(root / prefix);
+                break;
+            } else if (n == 0) {
+                break;
+            }
+            for (long off = 0; off < n;) {
+                const auto d = reinterpret_cast<linux_dirent64*>(buf.data() + off);
+                off += d->d_reclen;
+                const std::string_view name(d->d_name);
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                // Directories are recognizable from d_type alone, and we only
+                // need to know that they exist
+                if (d->d_type == DT_DIR) {
+                    children.emplace_back(name);
+                    continue;
+                }
+                struct statx stx;
+                if (!stat_at(dirfd, d->d_name, stx)) {
+                    // Removed while we were scanning
+                    continue;
+                }
+                // Index what links point to, as stat'ing the destination
+                // would. Dangling links are indexed as themselves.
+                struct statx target;
+                if (S_ISLNK(stx.stx_mode) && stat_at(dirfd, d->d_name, target, true)) {
+                    stx = target;
+                }
+                if (S_ISDIR(stx.stx_mode)) {
+                    children.emplace_back(name);
+                } else if (staged_destination(d->d_name)) {
+                    staged.push_back(root / (prefix + d->d_name));
+                } else {
+                    out.insert_or_assign(key(prefix + d->d_name), to_entry(stx));
+                }
+            }
+        }
+    }
+
+    for (const auto& child : children) {
+        auto child_prefix = prefix + child + "/";
+        if (subdirs != nullptr) {
+            subdirs->push_back(std::move(child_prefix));
+            continue;
+        }
+        int fd = openat(dirfd, child.c_str(), DIR_FLAGS);
+        if (fd < 0) {
+            errors.push_back(root / child_prefix);
+            continue;
+        }
+        scan(fd, child_prefix, out, errors, staged, ancestors, nullptr);
+    }
+    ancestors.pop_back();
+    close(dirfd);
+}
+
+std::optional<dest_entry_t> DestinationIndex::find(const path& p) const {
+    const auto normal = p.lexically_normal();
+    const auto relative = normal.lexically_relative(root);
+    if (relative.empty() || *relative.begin() == "..") {
+        struct statx stx;
+        if (!stat_at(AT_FDCWD, normal.c_str(), stx)) {
+            return std::nullopt;
+        }
+        return to_entry(stx);
+    }
+    const auto entry = entries.find(key(relative.string()));
+    if (entry == entries.end()) {
+        return std::nullopt;
+    }
+    return entry->second;
+}
+
+bool DestinationIndex::is_newer(const path& destination, const path& source) const {
+    const auto entry = find(destination);
+    if (!entry) {
+        return false;
+    }
+    struct stat st;
+    if (stat(source.c_str(), &st) == 0 && st.st_dev == entry->dev && st.st_ino == entry->ino) {
+        return true;
+    }
+    return entry->mtime > std::filesystem::last_write_time(source);
+}
+
+}  // namespace ddb_ows
@@ -0,0 +1,105 @@
+#include "fingerprint.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "hash.hpp"
+
+namespace ddb_ows {
+
+namespace {
+
+using std::filesystem::filesystem_error;
+using std::filesystem::path;
+
+constexpr size_t READ_SIZE = 1024 * 1024;
+
+[[noreturn]] void throw_errno(const char* what, const path& p) {
+    throw filesystem_error(what, p, std::error_code(errno, std::generic_category()));
+}
+
+// Hashes len bytes of fd starting at off, or up to EOF if it comes first
+uint64_t hash_range(
+    int fd,
+    const path& p,
+    off_t off,
+    uintmax_t len,
+    uint64_t hash,
+    IoLimiter* limiter,
+    const std::stop_token& stop
+) {
+    std::vector<char> buf(std::min<uintmax_t>(len, READ_SIZE));
+    while (len > 0) {
+        const size_t n_wanted = std::min<uintmax_t>(len, buf.size());
+        if (stop.stop_requested() ||
+            (limiter != nullptr && !limiter->acquire(n_wanted, 1, stop))) {
+            errno = ECANCELED;
+            throw_errno("Cancelled reading", p);
+        }
+        const ssize_t n = pread(fd, buf.data(), n_wanted, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            throw_errno("Could not read", p);
+        } else if (n == 0) {
+            break;
+        }
+        hash = hash_bytes(std::string_view(buf.data(), n), hash);
+        off += n;
+        len -= n;
+    }
+    return hash;
+}
+
+}  // namespace
+
+content_fingerprint_t fingerprint_file(
+    const path& p, fingerprint_method method, IoLimiter* limiter, std::stop_token stop
+) {
+    int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_errno("Could not open", p);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const int e = errno;
+        close(fd);
+        errno = e;
+        throw_errno("Could not stat", p);
+    }
+    const uintmax_t size = st.st_size;
+    // Seeding with the size makes the hash alone tell sizes apart
+    uint64_t hash = fnv1a(std::to_string(size));
+    try {
+        if (method == fingerprint_method::full || size <= 2 * FINGERPRINT_SAMPLE_SIZE) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            hash = hash_range(fd, p, 0, size, hash, limiter, stop);
+        } else {
+            hash = hash_range(fd, p, 0, FINGERPRINT_SAMPLE_SIZE, hash, limiter, stop);
+            hash = hash_range(
+                fd,
+                p,
+                size - FINGERPRINT_SAMPLE_SIZE,
+                FINGERPRINT_SAMPLE_SIZE,
+                hash,
+                limiter,
+                stop
+            );
+        }
+    } catch (filesystem_error&) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return {.size = size, .hash = hash};
+}
+
+}  // namespace ddb_ows
@@ -70,6 +70,17 @@ void on_rm_unref_check_toggled(GtkToggleButton* toggle, gpointer data) {
     ddb_ows->conf->set_rm_unref(rm_unref);
 }
 
+void on_io_limit_spinbutton_show(GtkWidget* widget, gpointer data) {
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(widget), ddb_ows->conf->get_io_limit_mbps());
+}
+
+void on_io_limit_spinbutton_value_changed(GtkSpinButton* spinbutton, gpointer data) {
+    unsigned int mbps = static_cast<unsigned int>(gtk_spin_button_get_value(spinbutton));
+    ddb_ows->conf->set_io_limit_mbps(mbps);
+    // Also throttle a sync that is already running
+    ddb_ows->set_io_limits(uintmax_t(mbps) << 20, ddb_ows->conf->get_io_limit_iops());
+}
+
 void on_sync_pls_dbpl_check_show(GtkWidget* widget, gpointer data) {
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(widget), ddb_ows->conf->get_sync_pls().dbpl);
 }
@@ -43,9 +43,15 @@ void ProgressMonitor::set_n_sources(size_t n) {
     sig_job_queued();
 }
 
-std::pair<float, std::string> queue_progress(size_t n_queued, size_t n_sources) {
+std::pair<float, std::string> queue_progress(
+    size_t n_queued, size_t n_sources, size_t n_finished
+) {
     const float p = pct(n_queued, n_sources);
-    return {p, fmt::format("Queueing jobs ({}/{}, {:.0f}%)", n_queued, n_sources, 100 * p)};
+    auto text = fmt::format("Queueing jobs ({}/{}, {:.0f}%)", n_queued, n_sources, 100 * p);
+    if (n_finished > 0) {
+        text += fmt::format(", {} finished", n_finished);
+    }
+    return {p, text};
 }
 
 void ProgressMonitor::job_queued() {
@@ -61,7 +67,7 @@ void ProgressMonitor::_job_queued() {
         return;
     }
 
-    auto [p, text] = queue_progress(n_queued, n_sources);
+    auto [p, text] = queue_progress(n_queued, n_sources, n_finished);
     if (pb != nullptr) {
         pb->set_fraction(p);
         pb->set_text(text);
@@ -78,7 +84,7 @@ void ProgressMonitor::_job_queued() {
 void ProgressMonitor::set_n_jobs(size_t n) {
     cancelled = false;
     n_jobs = n;
-    n_finished = 0;
+    queueing_complete = true;
     sig_job_finished();
 }
 
@@ -104,7 +110,10 @@ void ProgressMonitor::_job_finished() {
         return;
     }
 
-    auto [p, text] = job_progress(n_finished, n_jobs);
+    // While jobs are still being queued the total is growing, so report
+    // progress of queueing instead.
+    auto [p, text] = queueing_complete ? job_progress(n_finished, n_jobs)
+                                       : queue_progress(n_queued, n_sources, n_finished);
     if (pb != nullptr) {
         pb->set_fraction(p);
         pb->set_text(text);
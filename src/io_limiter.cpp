@@ -0,0 +1,75 @@
+#include "io_limiter.hpp"
+
+#include <algorithm>
+
+namespace ddb_ows {
+
+namespace {
+
+// Waiting requests wake up at least this often, so that new limits take
+// effect quickly
+constexpr std::chrono::milliseconds MAX_WAIT(100);
+
+}  // namespace
+
+void IoLimiter::bucket_t::refill(double seconds) {
+    if (rate > 0) {
+        tokens = std::min(rate, tokens + seconds * rate);
+    }
+}
+
+void IoLimiter::bucket_t::take(double n) {
+    if (rate > 0) {
+        tokens -= n;
+    }
+}
+
+void IoLimiter::_refill() {
+    const auto now = clock::now();
+    const double seconds = std::chrono::duration<double>(now - last).count();
+    last = now;
+    bytes.refill(seconds);
+    ops.refill(seconds);
+}
+
+void IoLimiter::set_limits(uintmax_t bytes_per_sec, unsigned int ops_per_sec) {
+    {
+        std::lock_guard lock(m);
+        _refill();
+        bytes.rate = bytes_per_sec;
+        ops.rate = ops_per_sec;
+        // Debt built up under a lower limit is repaid at the new rate, but
+        // savings never exceed one second at the new rate. Lifting a limit
+        // forgets its debt, or setting one later would repay it.
+        for (auto* bucket : {&bytes, &ops}) {
+            bucket->tokens = bucket->rate > 0 ? std::min(bucket->tokens, bucket->rate) : 0;
+        }
+    }
+    c.notify_all();
+}
+
+bool IoLimiter::acquire(uintmax_t n_bytes, unsigned int n_ops, std::stop_token stop) {
+    std::unique_lock lock(m);
+    while (true) {
+        _refill();
+        const double wait = std::max(bytes.wait(), ops.wait());
+        if (wait <= 0) {
+            break;
+        }
+        // Returns early only when stop is requested
+        c.wait_for(
+            lock,
+            stop,
+            std::min<std::chrono::duration<double>>(std::chrono::duration<double>(wait), MAX_WAIT),
+            [] { return false; }
+        );
+        if (stop.stop_requested()) {
+            return false;
+        }
+    }
+    bytes.take(n_bytes);
+    ops.take(n_ops);
+    return true;
+}
+
+}  // namespace ddb_ows
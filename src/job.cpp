@@ -1,11 +1,17 @@
 #include "job.hpp"
 
 #include <fmt/std.h>
+#include <unistd.h>
 
+#include <atomic>
 #include <filesystem>
 #include <optional>
+#include <string>
 #include <system_error>
 
+#include "fingerprint.hpp"
+#include "hash.hpp"
+
 using namespace std::filesystem;
 
 namespace ddb_ows {
@@ -25,25 +31,65 @@ std::chrono::seconds now() {
     return duration_cast<std::chrono::seconds>(system_clock::now().time_since_epoch());
 }
 
+void Job::register_stats(bool success, std::chrono::nanoseconds wall_time) {
+    db->register_job_stats(
+        {.sync_id = sync_id,
+         .source = source,
+         .destination = destination,
+         .kind = kind(),
+         .strategy = stats.strategy,
+         .bytes_read = stats.bytes_read,
+         .bytes_written = stats.bytes,
+         .duration = std::chrono::duration_cast<std::chrono::microseconds>(wall_time),
+         .success = success}
+    );
+}
+
 bool CopyJob::run(bool dry) {
     bool success;
     std::string from_to_str = fmt::format("from {} to {}", source, destination);
     try {
         if (!dry) {
             create_directories(destination.parent_path());
-            success = copy_file(source, destination, copy_options::update_existing);
-            if (success) {
-                register_job();
-                logger->log("Copied {}.", from_to_str);
+            const auto copied = copy_file_contents(source, destination, copy_opts);
+            stats = {
+                .strategy = copy_strategy_name(copied.strategy),
+                .bytes = copied.bytes,
+                .bytes_read = copied.bytes_read,
+                .duration = copied.duration,
+            };
+            register_job();
+            if (copied.strategy == copy_strategy::delta) {
+                logger->log(
+                    "Updated {} in place ({} KiB changed).", from_to_str, copied.bytes / 1024
+                );
+            } else if (copied.strategy == copy_strategy::hardlink ||
+                       copied.strategy == copy_strategy::symlink) {
+                logger->log("Linked {} ({}).", from_to_str, stats.strategy);
             } else {
-                logger->err("Failed to copy {}.", from_to_str);
+                const std::string resumed =
+                    copied.resumed_from > 0
+                        ? fmt::format(", resumed at {} MiB", copied.resumed_from / (1024 * 1024))
+                        : "";
+                logger->log(
+                    "Copied {} ({}, {:.1f} MiB/s{}).",
+                    from_to_str,
+                    stats.strategy,
+                    copied.throughput() / (1024 * 1024),
+                    resumed
+                );
             }
+            success = true;
         } else {
             success = true;
             logger->log("Would copy {}.", from_to_str);
         }
     } catch (filesystem_error& e) {
-        logger->err("Failed to copy {}: {}.", from_to_str, e.what());
+        if (e.code() == std::errc::operation_canceled) {
+            logger->log("Cancelled copying {}.", from_to_str);
+        } else {
+            logger->err("Failed to copy {}: {}.", from_to_str, e.what());
+        }
         success = false;
     }
     return success;
@@ -64,9 +110,10 @@ CopyJob::CopyJob(
     DatabaseHandle _db,
     sync_id_t _sync_id,
     path _source,
-    path _destination
+    path _destination,
+    const copy_opts_t& _copy_opts
 ) :
-    Job(_logger, _db, _sync_id, _source, _destination) {};
+    Job(_logger, _db, _sync_id, _source, _destination), copy_opts(_copy_opts) {};
 
 MoveJob::MoveJob(
     std::shared_ptr<Logger> _logger,
@@ -75,15 +122,26 @@ MoveJob::MoveJob(
     path _source,
     path _old_destination,
     path _destination,
-    std::optional<std::string> _converter_preset
+    std::optional<std::string> _converter_preset,
+    std::optional<path> _old_source
 ) :
     Job(_logger, _db, _sync_id, _source, _destination),
     old_destination(_old_destination),
-    converter_preset(_converter_preset) {};
+    converter_preset(_converter_preset),
+    old_source(_old_source) {};
 
 bool MoveJob::run(bool dry) {
     std::string from_to_str =
-        fmt::format("from {} to {} (original source: {})", old_destination, destination, source);
+        old_source ? fmt::format(
+                         "from {} to {} (source: {}, renamed from {})",
+                         old_destination,
+                         destination,
+                         source,
+                         *old_source
+                     )
+                   : fmt::format(
+                         "from {} to {} (original source: {})", old_destination, destination, source
+                     );
     bool success;
     try {
         if (!dry) {
@@ -107,7 +165,7 @@ void MoveJob::register_job() {
     // a move is registered as a delete followed by a recreation
     db->register_synced_file(
         {.sync_id = sync_id,
-         .source = source,
+         .source = old_source.value_or(source),
          .destination = std::nullopt,
          .converter_preset = std::nullopt,
          .timestamp = now()}
@@ -121,7 +179,13 @@ void MoveJob::register_job() {
     );
 }
 
-ConvertJob::~ConvertJob() { ddb->pl_item_unref(it); }
+ConvertJob::~ConvertJob() {
+    ddb->pl_item_unref(it);
+    if (!scratch.empty()) {
+        std::error_code e;
+        remove(scratch, e);
+    }
+}
 
 ConvertJob::ConvertJob(
     std::shared_ptr<Logger> _logger,
@@ -131,14 +195,122 @@ ConvertJob::ConvertJob(
     DB_playItem_t* _it,
     sync_id_t _sync_id,
     path _source,
-    path _destination
+    path _destination,
+    const copy_opts_t& _copy_opts,
+    path _scratch_dir,
+    std::shared_ptr<TranscodeCache> _cache
 ) :
     Job(_logger, _db, _sync_id, _source, _destination),
     ddb(_ddb),
     settings(_settings),
     it(_it),
-    pabort(0) {
+    pabort(0),
+    copy_opts(_copy_opts),
+    scratch_dir(_scratch_dir.empty() ? temp_directory_path() : _scratch_dir),
+    cache(_cache) {
     ddb->pl_item_ref(it);
+    duration = ddb->pl_get_item_duration(it);
+    if (duration <= 0) {
+        // Unknown, e.g. for some streams. Estimate from the size as if it
+        // were CD audio.
+        std::error_code e;
+        const auto size = file_size(source, e);
+        duration = e ? 0 : size / (44100.0 * 2 * 2);
+    }
+}
+
+path make_scratch_path(const path& dir, const path& destination) {
+    static std::atomic<unsigned int> counter = 0;
+    return dir /
+           fmt::format("ddb_ows-{}-{}{}", getpid(), counter++, destination.extension());
+}
+
+// Hashes the plugins of a DSP chain and their parameters, which presets of
+// the same title may differ in
+uint64_t hash_dsp_chain(const ddb_dsp_preset_t* preset, uint64_t hash) {
+    if (preset == nullptr) {
+        return fnv1a_field("", hash);
+    }
+    hash = fnv1a_field(preset->title != nullptr ? preset->title : "", hash);
+    for (auto* ctx = preset->chain; ctx != nullptr; ctx = ctx->next) {
+        const auto* dsp = ctx->plugin;
+        hash = fnv1a_field(dsp->plugin.id != nullptr ? dsp->plugin.id : "", hash);
+        hash = fnv1a_field(std::to_string(ctx->enabled), hash);
+        const int n_params = dsp->num_params != nullptr ? dsp->num_params() : 0;
+        for (int p = 0; p < n_params && dsp->get_param != nullptr; p++) {
+            char value[256] = "";
+            dsp->get_param(ctx, p, value, sizeof(value));
+            hash = fnv1a_field(value, hash);
+        }
+    }
+    return hash;
+}
+
+std::optional<content_fingerprint_t> ConvertJob::source_fingerprint() {
+    std::error_code e;
+    const auto mtime = last_write_time(source, e);
+    if (e) {
+        return std::nullopt;
+    }
+    const auto stored = db->get_content_fingerprint(source);
+    if (stored && stored->mtime == mtime && stored->method == fingerprint_method::full) {
+        return stored->fingerprint;
+    }
+    content_fingerprint_entry_t entry{.mtime = mtime, .method = fingerprint_method::full};
+    try {
+        entry.fingerprint = fingerprint_file(
+            source, fingerprint_method::full, copy_opts.limiter.get(), copy_opts.stop
+        );
+    } catch (filesystem_error&) {
+        return std::nullopt;
+    }
+    // Don't replace a current fingerprint of another method, which rename
+    // detection would only compute again
+    if (!stored || stored->mtime != mtime) {
+        db->register_content_fingerprint(source, entry);
+    }
+    return entry.fingerprint;
+}
+
+std::optional<std::string> ConvertJob::transcode_key() {
+    const auto content = source_fingerprint();
+    if (!content) {
+        return std::nullopt;
+    }
+    const auto* preset = settings.encoder_preset;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (const char* field : {preset->title, preset->ext, preset->encoder}) {
+        hash = fnv1a_field(field != nullptr ? field : "", hash);
+    }
+    for (int field :
+         {preset->method,
+          preset->tag_id3v2,
+          preset->tag_id3v1,
+          preset->tag_apev2,
+          preset->tag_flac,
+          preset->tag_oggvorbis,
+          preset->tag_mp3xing,
+          preset->tag_mp4,
+          preset->id3v2_version,
+          settings.output_bps,
+          settings.output_is_float,
+          settings.bypass_conversion_on_same_format,
+          settings.rewrite_tags_after_copy}) {
+        hash = fnv1a_field(std::to_string(field), hash);
+    }
+    hash = hash_dsp_chain(settings.dsp_preset, hash);
+    // The encoder writes the tags into its output. Keys starting with ':' are
+    // properties of the item rather than tags, e.g. its path.
+    ddb->pl_lock();
+    for (auto meta = ddb->pl_get_metadata_head(it); meta != nullptr; meta = meta->next) {
+        if (meta->key[0] == ':') {
+            continue;
+        }
+        hash = fnv1a_field(meta->key, hash);
+        hash = fnv1a_field(meta->value, hash);
+    }
+    ddb->pl_unlock();
+    return fmt::format("{:x}-{:016x}-{:016x}", content->size, content->hash, hash);
 }
 
 bool ConvertJob::run(bool dry) {
@@ -147,12 +319,55 @@ bool ConvertJob::run(bool dry) {
     if (!dry) {
         logger->verbose("Converting  {}.", from_to_str);
         auto* ddb_conv = reinterpret_cast<ddb_converter_t*>(ddb->plug_get_for_id("converter"));
-        // TODO implement cancelling
-        create_directories(destination.parent_path());
-        int out = ddb_conv->convert2(&settings, it, std::string(destination).c_str(), &pabort);
+        std::error_code e;
+        // Hashing the source and converting both take long, so we check for
+        // cancellation before each
+        const auto cancelled = [&] {
+            // The converter may have left a partial file behind
+            remove(scratch, e);
+            scratch.clear();
+            logger->log("Cancelled converting {}.", from_to_str);
+            return false;
+        };
+        if (std::atomic_ref(pabort).load()) {
+            return cancelled();
+        }
+        create_directories(scratch_dir, e);
+        scratch = make_scratch_path(scratch_dir, destination);
+        const auto key = cache ? transcode_key() : std::nullopt;
+        if (key && cache->fetch(*key, scratch, copy_opts)) {
+            logger->verbose("Converted {} from the transcode cache into {}.", from_to_str, scratch);
+            const auto scratch_size = file_size(scratch, e);
+            stats.strategy = "cache";
+            stats.bytes = e ? 0 : scratch_size;
+            stats.bytes_read = stats.bytes;
+            return true;
+        }
+        // The converter does its own I/O, which the limiter doesn't see.
+        // Charging it whole would put the other workers in debt for as long
+        // as the file takes at the limit, and the encoder reads the source at
+        // its own pace anyway. The output goes to local scratch, and the
+        // install is charged if it has to copy it.
+        const auto source_size = file_size(source, e);
+        stats.bytes_read = e ? 0 : source_size;
+        if (std::atomic_ref(pabort).load()) {
+            return cancelled();
+        }
+        int out = ddb_conv->convert2(&settings, it, std::string(scratch).c_str(), &pabort);
+        if (std::atomic_ref(pabort).load()) {
+            return cancelled();
+        }
         if (!out) {
-            register_job();
-            logger->log("Conversion of {} successful.", from_to_str);
+            const auto scratch_size = file_size(scratch, e);
+            stats.bytes = e ? 0 : scratch_size;
+            logger->verbose("Converted {} into {}.", from_to_str, scratch);
+            if (key) {
+                try {
+                    cache->store(*key, scratch, copy_opts);
+                } catch (filesystem_error& e) {
+                    logger->warn("Could not add {} to the transcode cache: {}.", scratch, e.what());
+                }
+            }
         } else {
             logger->err("Converting {} failed.", from_to_str);
         }
@@ -163,18 +378,114 @@ bool ConvertJob::run(bool dry) {
     }
 }
 
-void ConvertJob::register_job() {
+std::unique_ptr<Job> ConvertJob::continuation() {
+    if (scratch.empty()) {
+        // Dry run
+        return nullptr;
+    }
+    auto out = std::make_unique<InstallJob>(
+        logger,
+        db,
+        sync_id,
+        source,
+        scratch,
+        destination,
+        settings.encoder_preset->title,
+        copy_opts
+    );
+    scratch.clear();
+    return out;
+}
+
+void ConvertJob::abort() { interrupt(); }
+
+void ConvertJob::interrupt() { std::atomic_ref(pabort).store(1); }
+
+InstallJob::InstallJob(
+    std::shared_ptr<Logger> _logger,
+    DatabaseHandle _db,
+    sync_id_t _sync_id,
+    path _source,
+    path _scratch,
+    path _destination,
+    std::optional<std::string> _converter_preset,
+    const copy_opts_t& _copy_opts
+) :
+    Job(_logger, _db, _sync_id, _source, _destination),
+    scratch(_scratch),
+    converter_preset(_converter_preset),
+    copy_opts(_copy_opts) {
+    std::error_code e;
+    const auto size = file_size(scratch, e);
+    scratch_bytes = e ? 0 : size;
+};
+
+InstallJob::~InstallJob() { abort(); }
+
+bool InstallJob::run(bool dry) {
+    std::string from_to_str = fmt::format("{} from {} (source: {})", destination, scratch, source);
+    if (dry) {
+        logger->log("Would install {}.", from_to_str);
+        return true;
+    }
+    try {
+        create_directories(destination.parent_path());
+        std::error_code e;
+        rename(scratch, destination, e);
+        if (e == std::errc::cross_device_link) {
+            // Linking to the scratch file would leave a dangling symbolic
+            // link once it is removed
+            auto opts = copy_opts;
+            opts.link = link_mode::copy;
+            const auto copied = copy_file_contents(scratch, destination, opts);
+            stats = {
+                .strategy = copy_strategy_name(copied.strategy),
+                .bytes = copied.bytes,
+                .bytes_read = copied.bytes_read,
+                .duration = copied.duration,
+            };
+            remove(scratch);
+        } else if (e) {
+            throw filesystem_error("Could not rename", scratch, destination, e);
+        } else {
+            // The encoder already wrote the file to the destination's
+            // filesystem, so it counts as written here like a copied one
+            stats.strategy = "rename";
+            stats.bytes = scratch_bytes;
+        }
+    } catch (filesystem_error& e) {
+        if (e.code() == std::errc::operation_canceled) {
+            logger->log("Cancelled installing {}.", from_to_str);
+            abort();
+        } else {
+            logger->err("Failed to install {}: {}.", from_to_str, e.what());
+        }
+        return false;
+    }
+    scratch.clear();
+    register_job();
+    logger->log("Installed {}.", from_to_str);
+    return true;
+}
+
+void InstallJob::abort() {
+    if (!scratch.empty()) {
+        std::error_code e;
+        remove(scratch, e);
+        scratch.clear();
+    }
+}
+
+void InstallJob::register_job() {
     db->register_synced_file(
         {.sync_id = sync_id,
          .source = source,
          .destination = destination,
-         .converter_preset = settings.encoder_preset->title,
+         .converter_preset = converter_preset,
          .timestamp = now()}
     );
 }
 
-void ConvertJob::abort() { pabort = 1; }
-
 DeleteJob::DeleteJob(
     std::shared_ptr<Logger> _logger,
     DatabaseHandle _db,
@@ -1,31 +1,168 @@
 #include "jobsqueue.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
 
 #include "job.hpp"
 
 namespace ddb_ows {
 
+bool JobsQueue::heap_less(const queued_job& a, const queued_job& b) {
+    return a.cost < b.cost || (a.cost == b.cost && a.seq > b.seq);
+}
+
+void JobsQueue::_push(std::unique_ptr<Job> job) {
+    const auto lane = static_cast<size_t>(job->lane());
+    const double cost = order[lane] == job_order::fifo ? 0 : job->cost();
+    q[lane].push_back(
+        {.cost = cost,
+         .seq = next_seq++,
+         .pushed = std::chrono::steady_clock::now(),
+         .job = std::move(job)}
+    );
+    if (order[lane] == job_order::longest_first) {
+        std::push_heap(q[lane].begin(), q[lane].end(), heap_less);
+    }
+    // Workers of other lanes may be waiting as well
+    c.notify_all();
+}
+
+std::unique_ptr<Job> JobsQueue::_pop(size_t lane) {
+    using namespace std::chrono;
+    if (order[lane] == job_order::longest_first) {
+        std::pop_heap(q[lane].begin(), q[lane].end(), heap_less);
+    }
+    auto& next = order[lane] == job_order::longest_first ? q[lane].back() : q[lane].front();
+    auto val = std::move(next.job);
+    n_started[lane]++;
+    wait_seconds[lane] += duration<double>(steady_clock::now() - next.pushed).count();
+    if (order[lane] == job_order::longest_first) {
+        q[lane].pop_back();
+    } else {
+        q[lane].pop_front();
+    }
+    return val;
+}
+
+void JobsQueue::set_order(job_lane lane, job_order _order) {
+    std::lock_guard<std::mutex> lock(m);
+    order[static_cast<size_t>(lane)] = _order;
+}
+
+void JobsQueue::set_scratch_limits(size_t max_files, uintmax_t max_bytes) {
+    std::lock_guard<std::mutex> lock(m);
+    max_scratch_files = max_files;
+    max_scratch_bytes = max_bytes;
+    c.notify_all();
+}
+
+void JobsQueue::set_limit(job_lane lane, size_t n) {
+    std::lock_guard<std::mutex> lock(m);
+    limit[static_cast<size_t>(lane)] = n;
+    c.notify_all();
+}
+
+bool JobsQueue::_drained() {
+    if (isOpen) {
+        return false;
+    }
+    for (size_t lane = 0; lane < N_JOB_LANES; lane++) {
+        if (!q[lane].empty() || n_running[lane] > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void JobsQueue::push_back(std::unique_ptr<Job> job) {
     std::lock_guard<std::mutex> lock(m);
     if (!isOpen) {
         return;
     }
-    q.push_back(std::move(job));
-    c.notify_one();
+    _push(std::move(job));
+    n_pushed++;
+}
+
+void JobsQueue::push_continuation(std::unique_ptr<Job> job) {
+    std::lock_guard<std::mutex> lock(m);
+    if (cancelled) {
+        job->abort();
+        return;
+    }
+    if (const auto size = job->scratch_size(); size > 0) {
+        n_scratch++;
+        scratch_bytes += size;
+    }
+    _push(std::move(job));
 }
 
-std::unique_ptr<Job> JobsQueue::pop() {
+void JobsQueue::_release_scratch(const Job& job) {
+    if (const auto size = job.scratch_size(); size > 0) {
+        n_scratch--;
+        scratch_bytes -= size;
+        c.notify_all();
+    }
+}
+
+bool JobsQueue::_may_start(size_t lane) {
+    if (q[lane].empty() || n_running[lane] >= limit[lane]) {
+        return false;
+    }
+    return lane != static_cast<size_t>(job_lane::cpu) ||
+           (n_scratch <= max_scratch_files && scratch_bytes <= max_scratch_bytes);
+}
+
+std::unique_ptr<Job> JobsQueue::pop(job_lane lane) {
+    const auto i = static_cast<size_t>(lane);
     std::unique_lock<std::mutex> lock(m);
-    c.wait(lock, [this] { return !this->q.empty() || !this->isOpen; });
-    if (!this->q.empty()) {
-        std::unique_ptr<Job> val = std::move(q.front());
-        q.pop_front();
-        return val;
+    c.wait(lock, [this, i] { return this->_may_start(i) || this->_drained(); });
+    if (!this->q[i].empty()) {
+        n_running[i]++;
+        return _pop(i);
     } else {
         return std::unique_ptr<Job>();
     }
 }
+
+bool JobsQueue::run(Job& job, bool dry) {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (cancelled) {
+            job.abort();
+            _release_scratch(job);
+            return false;
+        }
+        running.insert(&job);
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const bool out = job.run(dry);
+    if (!dry) {
+        job.register_stats(out, std::chrono::steady_clock::now() - start);
+    }
+    std::lock_guard<std::mutex> lock(m);
+    running.erase(&job);
+    _release_scratch(job);
+    const auto lane = static_cast<size_t>(job.lane());
+    n_done[lane]++;
+    bytes_done[lane] += job.get_stats().bytes;
+    return out;
+}
+
+void JobsQueue::done(job_lane lane) {
+    std::lock_guard<std::mutex> lock(m);
+    const auto i = static_cast<size_t>(lane);
+    n_running[i]--;
+    if (_drained() || n_running[i] + 1 == limit[i]) {
+        c.notify_all();
+    }
+}
+
+bool JobsQueue::wait_drained(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(m);
+    return c.wait_for(lock, timeout, [this] { return this->_drained(); });
+}
+
 void JobsQueue::close() {
     std::lock_guard<std::mutex> lock(m);
     isOpen = false;
@@ -34,31 +171,63 @@ void JobsQueue::close() {
 
 void JobsQueue::open() {
     std::lock_guard<std::mutex> lock(m);
+    if (!isOpen) {
+        n_pushed = 0;
+        cancelled = false;
+    }
     isOpen = true;
     c.notify_all();
 }
 void JobsQueue::cancel() {
     std::lock_guard<std::mutex> lock(m);
     isOpen = false;
-    std::unique_ptr<Job> val;
-    while (!q.empty()) {
-        val = std::move(q.front());
-        val->abort();
-        q.pop_front();
+    cancelled = true;
+    for (auto& lane : q) {
+        for (auto& queued : lane) {
+            queued.job->abort();
+            _release_scratch(*queued.job);
+        }
+        lane.clear();
+    }
+    for (auto* job : running) {
+        job->interrupt();
     }
     c.notify_all();
 }
 
 bool JobsQueue::empty() {
     std::lock_guard<std::mutex> lock(m);
-    bool out = q.empty();
-    return out;
+    for (const auto& lane : q) {
+        if (!lane.empty()) {
+            return false;
+        }
+    }
+    return true;
 }
 
 size_t JobsQueue::size() {
     std::lock_guard<std::mutex> lock(m);
-    int out = q.size();
+    size_t out = 0;
+    for (const auto& lane : q) {
+        out += lane.size();
+    }
     return out;
 }
 
+size_t JobsQueue::total() {
+    std::lock_guard<std::mutex> lock(m);
+    return n_pushed;
+}
+
+JobsQueue::lane_stats_t JobsQueue::lane_stats(job_lane lane) {
+    std::lock_guard<std::mutex> lock(m);
+    const auto i = static_cast<size_t>(lane);
+    return {
+        .n_done = n_done[i],
+        .bytes_done = bytes_done[i],
+        .n_started = n_started[i],
+        .wait_seconds = wait_seconds[i],
+    };
+}
+
 }  // namespace ddb_ows
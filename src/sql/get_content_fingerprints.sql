@@ -0,0 +1,8 @@
+SELECT
+    files.source AS source,
+    fps.mtime AS mtime,
+    fps.method AS method,
+    fps.size AS size,
+    fps.hash AS hash
+FROM content_fingerprints AS fps
+INNER JOIN files ON files.id = fps.file_id;
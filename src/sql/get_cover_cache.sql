@@ -0,0 +1,6 @@
+SELECT
+    source_dir,
+    dir_mtime,
+    image_filename,
+    image_mtime
+FROM cover_cache;
@@ -0,0 +1,13 @@
+SELECT
+    kind,
+    strategy,
+    COUNT(*) AS n_jobs,
+    SUM(NOT success) AS n_failed,
+    SUM(bytes_read) AS bytes_read,
+    SUM(bytes_written) AS bytes_written,
+    SUM(duration_us) AS duration_us,
+    MAX(duration_us) AS max_duration_us
+FROM job_stats
+WHERE sync_id = :sync_id
+GROUP BY kind, strategy
+ORDER BY SUM(duration_us) DESC;
@@ -0,0 +1,6 @@
+SELECT
+    files.source AS source,
+    paths.fingerprint AS fingerprint,
+    paths.output_path AS output_path
+FROM output_paths AS paths
+INNER JOIN files ON files.id = paths.file_id;
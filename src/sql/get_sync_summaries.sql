@@ -0,0 +1,18 @@
+SELECT
+    syncs.id AS sync_id,
+    syncs.timestamp AS timestamp,
+    syncs.save_playlists_ms AS save_playlists_ms,
+    syncs.gather_ms AS gather_ms,
+    syncs.plan_ms AS plan_ms,
+    syncs.cover_ms AS cover_ms,
+    syncs.execute_ms AS execute_ms,
+    COUNT(job_stats.sync_id) AS n_jobs,
+    COALESCE(SUM(NOT job_stats.success), 0) AS n_failed,
+    COALESCE(SUM(job_stats.bytes_read), 0) AS bytes_read,
+    COALESCE(SUM(job_stats.bytes_written), 0) AS bytes_written,
+    COALESCE(SUM(job_stats.duration_us), 0) AS duration_us
+FROM syncs
+LEFT JOIN job_stats ON job_stats.sync_id = syncs.id
+GROUP BY syncs.id
+ORDER BY syncs.id DESC
+LIMIT :limit;
@@ -0,0 +1,17 @@
+SELECT source, destination, conversion_preset, timestamp, sync_id
+FROM (
+    SELECT
+        files.source AS source,
+        synced.destination AS destination,
+        synced.conversion_preset AS conversion_preset,
+        synced.timestamp AS timestamp,
+        synced.sync_id AS sync_id,
+        ROW_NUMBER() OVER (
+            PARTITION BY synced.file_id
+            ORDER BY synced.timestamp DESC, synced.destination DESC
+        ) AS n
+    FROM files
+    INNER JOIN synced_files AS synced
+    ON files.id = synced.file_id
+)
+WHERE n = 1
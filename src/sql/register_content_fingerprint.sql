@@ -0,0 +1,14 @@
+INSERT INTO content_fingerprints (file_id, mtime, method, size, hash)
+SELECT
+    id AS file_id,
+    :mtime AS mtime,
+    :method AS method,
+    :size AS size,
+    :hash AS hash
+FROM files
+WHERE source = :source
+ON CONFLICT (file_id) DO UPDATE SET
+    mtime = excluded.mtime,
+    method = excluded.method,
+    size = excluded.size,
+    hash = excluded.hash;
@@ -0,0 +1,6 @@
+INSERT INTO cover_cache (source_dir, dir_mtime, image_filename, image_mtime)
+VALUES (:source_dir, :dir_mtime, :image_filename, :image_mtime)
+ON CONFLICT (source_dir) DO UPDATE SET
+    dir_mtime = excluded.dir_mtime,
+    image_filename = excluded.image_filename,
+    image_mtime = excluded.image_mtime;
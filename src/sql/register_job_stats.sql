@@ -0,0 +1,21 @@
+INSERT INTO job_stats (
+    sync_id,
+    file_id,
+    destination,
+    kind,
+    strategy,
+    bytes_read,
+    bytes_written,
+    duration_us,
+    success)
+VALUES (
+    :sync_id,
+    (SELECT id FROM files WHERE source = :source),
+    :destination,
+    :kind,
+    :strategy,
+    :bytes_read,
+    :bytes_written,
+    :duration_us,
+    :success
+);
@@ -0,0 +1,10 @@
+INSERT INTO output_paths (file_id, fingerprint, output_path)
+SELECT
+    id AS file_id,
+    :fingerprint AS fingerprint,
+    :output_path AS output_path
+FROM files
+WHERE source = :source
+ON CONFLICT (file_id) DO UPDATE SET
+    fingerprint = excluded.fingerprint,
+    output_path = excluded.output_path;
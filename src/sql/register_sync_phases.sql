@@ -0,0 +1,7 @@
+UPDATE syncs SET
+    save_playlists_ms = :save_playlists_ms,
+    gather_ms = :gather_ms,
+    plan_ms = :plan_ms,
+    cover_ms = :cover_ms,
+    execute_ms = :execute_ms
+WHERE id = :sync_id;
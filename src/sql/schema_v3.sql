@@ -0,0 +1,16 @@
+BEGIN TRANSACTION;
+
+CREATE TABLE IF NOT EXISTS "output_paths" (
+    "file_id"	INTEGER NOT NULL UNIQUE,
+    "fingerprint"	INTEGER NOT NULL,
+    "output_path"	TEXT NOT NULL,
+    PRIMARY KEY("file_id"),
+    FOREIGN KEY("file_id") REFERENCES "files"("id")
+);
+
+INSERT INTO meta (key, value) VALUES ('schema_version', '3')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+INSERT INTO meta (key, value) VALUES ('app_version', '0.6.0')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+
+COMMIT;
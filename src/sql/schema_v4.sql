@@ -0,0 +1,16 @@
+BEGIN TRANSACTION;
+
+CREATE TABLE IF NOT EXISTS "cover_cache" (
+    "source_dir"	TEXT NOT NULL UNIQUE,
+    "dir_mtime"	INTEGER NOT NULL,
+    "image_filename"	TEXT NOT NULL,
+    "image_mtime"	INTEGER NOT NULL,
+    PRIMARY KEY("source_dir")
+);
+
+INSERT INTO meta (key, value) VALUES ('schema_version', '4')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+INSERT INTO meta (key, value) VALUES ('app_version', '0.6.0')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+
+COMMIT;
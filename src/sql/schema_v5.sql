@@ -0,0 +1,18 @@
+BEGIN TRANSACTION;
+
+CREATE TABLE IF NOT EXISTS "content_fingerprints" (
+    "file_id"	INTEGER NOT NULL UNIQUE,
+    "mtime"	INTEGER NOT NULL,
+    "method"	INTEGER NOT NULL,
+    "size"	INTEGER NOT NULL,
+    "hash"	INTEGER NOT NULL,
+    PRIMARY KEY("file_id"),
+    FOREIGN KEY("file_id") REFERENCES "files"("id")
+);
+
+INSERT INTO meta (key, value) VALUES ('schema_version', '5')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+INSERT INTO meta (key, value) VALUES ('app_version', '0.6.0')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+
+COMMIT;
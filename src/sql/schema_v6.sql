@@ -0,0 +1,31 @@
+BEGIN TRANSACTION;
+
+ALTER TABLE "syncs" ADD COLUMN "save_playlists_ms" INTEGER;
+ALTER TABLE "syncs" ADD COLUMN "gather_ms" INTEGER;
+ALTER TABLE "syncs" ADD COLUMN "plan_ms" INTEGER;
+ALTER TABLE "syncs" ADD COLUMN "cover_ms" INTEGER;
+ALTER TABLE "syncs" ADD COLUMN "execute_ms" INTEGER;
+
+CREATE TABLE IF NOT EXISTS "job_stats" (
+    "sync_id"	INTEGER NOT NULL,
+    "file_id"	INTEGER,
+    "destination"	TEXT,
+    "kind"	TEXT NOT NULL,
+    "strategy"	TEXT,
+    "bytes_read"	INTEGER NOT NULL,
+    "bytes_written"	INTEGER NOT NULL,
+    "duration_us"	INTEGER NOT NULL,
+    "success"	INTEGER NOT NULL,
+    FOREIGN KEY("sync_id") REFERENCES "syncs"("id"),
+    FOREIGN KEY("file_id") REFERENCES "files"("id")
+);
+CREATE INDEX IF NOT EXISTS "idx_job_stats_sync" ON "job_stats" (
+    "sync_id"	ASC
+);
+
+INSERT INTO meta (key, value) VALUES ('schema_version', '6')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+INSERT INTO meta (key, value) VALUES ('app_version', '0.6.0')
+    ON CONFLICT DO UPDATE SET value=excluded.value;
+
+COMMIT;
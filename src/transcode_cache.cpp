@@ -0,0 +1,112 @@
+#include "transcode_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+namespace ddb_ows {
+
+using std::filesystem::file_time_type;
+using std::filesystem::filesystem_error;
+using std::filesystem::path;
+
+namespace {
+
+// Only the limiter and cancellation apply to copies into and out of the cache.
+// Staging protects the cache itself from partial files.
+copy_opts_t cache_copy_opts(const copy_opts_t& opts, bool staged) {
+    copy_opts_t out;
+    out.backend = opts.backend;
+    out.queue_depth = opts.queue_depth;
+    out.limiter = opts.limiter;
+    out.stop = opts.stop;
+    out.staged = staged;
+    return out;
+}
+
+}  // namespace
+
+bool TranscodeCache::fetch(const std::string& key, const path& out, const copy_opts_t& opts) {
+    const path entry = dir / key;
+    std::error_code e;
+    if (!exists(entry, e)) {
+        return false;
+    }
+    try {
+        copy_file_contents(entry, out, cache_copy_opts(opts, false));
+    } catch (filesystem_error&) {
+        // E.g. evicted in the meantime
+        remove(out, e);
+        return false;
+    }
+    // The mtime records when an entry was last used, across sessions
+    const auto now = file_time_type::clock::now();
+    last_write_time(entry, now, e);
+    std::lock_guard lock(m);
+    _load();
+    if (auto found = entries->find(key); found != entries->end()) {
+        found->second.last_used = now;
+    }
+    return true;
+}
+
+void TranscodeCache::store(const std::string& key, const path& file, const copy_opts_t& opts) {
+    create_directories(dir);
+    const auto copied = copy_file_contents(file, dir / key, cache_copy_opts(opts, true));
+    std::lock_guard lock(m);
+    _load();
+    // Replaces the entry if another job stored the same key in the meantime
+    auto& entry = (*entries)[key];
+    total = total - entry.size + copied.bytes;
+    entry = {.last_used = file_time_type::clock::now(), .size = copied.bytes};
+    _evict();
+}
+
+void TranscodeCache::_load() {
+    if (entries) {
+        return;
+    }
+    entries.emplace();
+    std::error_code e;
+    for (const auto& f : std::filesystem::directory_iterator(dir, e)) {
+        // Skip staging files of entries that are being stored
+        if (f.path().filename().string().starts_with(".") || !f.is_regular_file(e)) {
+            continue;
+        }
+        const auto mtime = f.last_write_time(e);
+        const auto size = f.file_size(e);
+        if (e) {
+            continue;
+        }
+        entries->insert_or_assign(f.path().filename().string(), entry_t{mtime, size});
+        total += size;
+    }
+}
+
+void TranscodeCache::_evict() {
+    if (total <= max_size) {
+        return;
+    }
+    std::vector<std::tuple<file_time_type, uintmax_t, std::string>> lru;
+    lru.reserve(entries->size());
+    for (const auto& [key, entry] : *entries) {
+        lru.emplace_back(entry.last_used, entry.size, key);
+    }
+    std::sort(lru.begin(), lru.end());
+    std::error_code e;
+    for (const auto& [_, size, key] : lru) {
+        if (total <= max_size) {
+            break;
+        }
+        // An entry that is already gone no longer takes up space either
+        if (!remove(dir / key, e) && e) {
+            continue;
+        }
+        entries->erase(key);
+        total -= size;
+    }
+}
+
+}  // namespace ddb_ows
@@ -0,0 +1,416 @@
+#include "uring_copy.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+
+namespace ddb_ows {
+
+namespace {
+
+constexpr size_t BUFFER_ALIGNMENT = 4096;
+
+[[noreturn]] void throw_errno(
+    int err,
+    const char* what,
+    const std::filesystem::path& source,
+    const std::filesystem::path& destination
+) {
+    throw std::filesystem::filesystem_error(
+        what, source, destination, std::error_code(err, std::generic_category())
+    );
+}
+
+io_uring_sqe prep_openat(const char* path, int flags, mode_t mode, uint64_t user_data) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<uint64_t>(path);
+    sqe.len = mode;
+    sqe.open_flags = flags;
+    sqe.user_data = user_data;
+    return sqe;
+}
+
+io_uring_sqe prep_close(int fd, uint64_t user_data) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_CLOSE;
+    sqe.fd = fd;
+    sqe.user_data = user_data;
+    return sqe;
+}
+
+}  // namespace
+
+UringCopier* UringCopier::for_thread(unsigned int queue_depth) {
+    thread_local std::unique_ptr<UringCopier> copier;
+    thread_local bool unavailable = false;
+    queue_depth = std::max(1u, queue_depth);
+    if (unavailable) {
+        return nullptr;
+    }
+    if (copier == nullptr || copier->depth != queue_depth || copier->broken) {
+        copier.reset(new UringCopier(queue_depth));
+        if (!copier->setup() || !copier->supports_ops()) {
+            copier.reset();
+            unavailable = true;
+        }
+    }
+    return copier.get();
+}
+
+UringCopier::UringCopier(unsigned int queue_depth) : depth(queue_depth) {}
+
+UringCopier::~UringCopier() {
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != nullptr && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != nullptr) {
+        munmap(sq_ptr, sq_size);
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+}
+
+bool UringCopier::setup() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Leave room for the opens and closes around a full pipeline
+    ring_fd = syscall(SYS_io_uring_setup, depth + 2, &params);
+    if (ring_fd < 0) {
+        return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    auto map = [this](size_t size, off_t offset) -> void* {
+        void* ptr = mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset
+        );
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    };
+    sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+    if (sq_ptr == nullptr) {
+        return false;
+    }
+    cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+    if (cq_ptr == nullptr) {
+        return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+    if (sqes == nullptr) {
+        return false;
+    }
+
+    auto sq = static_cast<char*>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    auto cq = static_cast<char*>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+bool UringCopier::supports_ops() {
+    constexpr unsigned int n_ops = 256;
+    std::vector<char> buf(sizeof(io_uring_probe) + n_ops * sizeof(io_uring_probe_op));
+    auto probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    if (syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, n_ops) < 0) {
+        return false;
+    }
+    for (const int op : {IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+io_uring_sqe* UringCopier::get_sqe() {
+    const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head >= sq_entries) {
+        return nullptr;
+    }
+    const unsigned idx = sq_local_tail & sq_mask;
+    sq_array[idx] = idx;
+    sq_local_tail++;
+    memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+    return &sqes[idx];
+}
+
+int UringCopier::enter(unsigned int min_complete) {
+    const unsigned to_submit = sq_local_tail - *sq_tail;
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        const long res =
+            syscall(SYS_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        if (res >= 0) {
+            return 0;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -errno;
+        }
+    }
+}
+
+std::optional<UringCopier::completion_t> UringCopier::pop_cqe() {
+    const unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return std::nullopt;
+    }
+    const auto& cqe = cqes[head & cq_mask];
+    const completion_t out{.user_data = cqe.user_data, .res = cqe.res};
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return out;
+}
+
+std::vector<int> UringCopier::run(const std::vector<io_uring_sqe>& ops) {
+    for (size_t i = 0; i < ops.size(); i++) {
+        *get_sqe() = ops[i];
+        sqes[(sq_local_tail - 1) & sq_mask].user_data = i;
+    }
+    std::vector<int> results(ops.size(), -ECANCELED);
+    size_t n_done = 0;
+    while (n_done < ops.size()) {
+        if (const int err = enter(1); err < 0) {
+            std::fill(results.begin(), results.end(), err);
+            broken = true;
+            break;
+        }
+        while (const auto cqe = pop_cqe()) {
+            results[cqe->user_data] = cqe->res;
+            n_done++;
+        }
+    }
+    return results;
+}
+
+void UringCopier::prep_read(unsigned int i, int fd) {
+    auto& slot = slots[i];
+    auto sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(slot.buf.get());
+    sqe->len = slot.len - slot.pos;
+    sqe->off = slot.off + slot.pos;
+    sqe->user_data = i << 1;
+}
+
+void UringCopier::prep_write(unsigned int i, int fd) {
+    auto& slot = slots[i];
+    auto sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(slot.buf.get() + slot.n_written);
+    sqe->len = slot.n_read - slot.n_written;
+    sqe->off = slot.off + slot.pos + slot.n_written;
+    sqe->user_data = (i << 1) | 1;
+}
+
+copy_stats_t UringCopier::copy(
+    const path& source, const path& destination, const copy_opts_t& opts
+) {
+    const auto start = std::chrono::steady_clock::now();
+
+    const size_t chunk_size =
+        (opts.buffer_size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    if (slots.size() != depth || slot_size != chunk_size) {
+        slots.clear();
+        for (unsigned int i = 0; i < depth; i++) {
+            auto buf = static_cast<char*>(std::aligned_alloc(BUFFER_ALIGNMENT, chunk_size));
+            if (buf == nullptr) {
+                slots.clear();
+                throw_errno(ENOMEM, "Could not allocate copy buffers", source, destination);
+            }
+            slots.push_back({.buf = {buf, &std::free}});
+        }
+        slot_size = chunk_size;
+    }
+
+    // The destination is only opened, and thus truncated, if the source could
+    // be opened. Its mode is fixed up once we know the source's.
+    auto open_in = prep_openat(source.c_str(), O_RDONLY | O_CLOEXEC, 0, 0);
+    open_in.flags |= IOSQE_IO_LINK;
+    const auto opened = run({
+        open_in,
+        prep_openat(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600, 0),
+    });
+    const int in = opened[0];
+    const int out = opened[1];
+    auto close_both = [&] {
+        if (broken) {
+            // Closes submitted to the ring may never complete
+            if (in >= 0) {
+                close(in);
+            }
+            return out >= 0 && close(out) != 0 ? -errno : 0;
+        }
+        std::vector<io_uring_sqe> closes;
+        if (in >= 0) {
+            closes.push_back(prep_close(in, 0));
+        }
+        if (out >= 0) {
+            closes.push_back(prep_close(out, 0));
+        }
+        const auto closed = run(closes);
+        // Only errors closing the destination matter, as they may be deferred
+        // write errors
+        return out >= 0 ? closed.back() : 0;
+    };
+    if (in < 0 || out < 0) {
+        close_both();
+        throw_errno(
+            in < 0 ? -in : -out,
+            in < 0 ? "Could not open source" : "Could not open destination",
+            source,
+            destination
+        );
+    }
+
+    struct stat st;
+    int err = 0;
+    const char* what = "Could not copy";
+    if (fstat(in, &st) != 0) {
+        err = errno;
+        what = "Could not stat source";
+    } else if (!S_ISREG(st.st_mode)) {
+        err = EINVAL;
+        what = "Source is not a regular file";
+    } else if (fchmod(out, st.st_mode & 07777) != 0) {
+        err = errno;
+        what = "Could not set permissions of destination";
+    }
+    if (err != 0) {
+        close_both();
+        throw_errno(err, what, source, destination);
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Every slot copies one chunk at a time: it reads the chunk, writes what
+    // was read, and repeats until the chunk is done, then takes the next one.
+    const off_t size = st.st_size;
+    WritebackThrottle wb(out, opts.write_budget.get());
+    off_t next_off = 0;
+    off_t eof = size;
+    unsigned int in_flight = 0;
+    auto next_chunk = [&](unsigned int i) {
+        if (err != 0 || next_off >= size) {
+            return;
+        }
+        auto& slot = slots[i];
+        slot.off = next_off;
+        slot.len = std::min<off_t>(slot_size, size - next_off);
+        slot.pos = 0;
+        next_off += slot.len;
+        if (opts.stop.stop_requested() ||
+            (opts.limiter && !opts.limiter->acquire(slot.len, 1, opts.stop))) {
+            err = ECANCELED;
+            return;
+        }
+        prep_read(i, in);
+        in_flight++;
+    };
+    for (unsigned int i = 0; i < depth; i++) {
+        next_chunk(i);
+    }
+    while (in_flight > 0) {
+        if (const int res = enter(1); res < 0) {
+            // The kernel still owns the buffers of the operations in flight,
+            // so we can't reuse them or this ring
+            for (auto& slot : slots) {
+                slot.buf.release();
+            }
+            slots.clear();
+            broken = true;
+            close_both();
+            throw_errno(-res, "io_uring_enter failed", source, destination);
+        }
+        while (const auto cqe = pop_cqe()) {
+            in_flight--;
+            const unsigned int i = cqe->user_data >> 1;
+            const bool is_write = cqe->user_data & 1;
+            auto& slot = slots[i];
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                is_write ? prep_write(i, out) : prep_read(i, in);
+                in_flight++;
+                continue;
+            } else if (cqe->res < 0) {
+                err = err != 0 ? err : -cqe->res;
+                continue;
+            } else if (err != 0) {
+                continue;
+            }
+
+            if (!is_write && cqe->res == 0) {
+                // The source shrank while we were copying it
+                eof = std::min<off_t>(eof, slot.off + slot.pos);
+                continue;
+            } else if (!is_write) {
+                slot.n_read = cqe->res;
+                slot.n_written = 0;
+                prep_write(i, out);
+                in_flight++;
+                continue;
+            }
+
+            slot.n_written += cqe->res;
+            if (slot.n_written < slot.n_read) {
+                prep_write(i, out);
+                in_flight++;
+                continue;
+            }
+            wb.wrote(slot.off + slot.pos, slot.n_read);
+            slot.pos += slot.n_read;
+            if (slot.pos < slot.len) {
+                prep_read(i, in);
+                in_flight++;
+            } else {
+                next_chunk(i);
+            }
+        }
+    }
+
+    if (err == 0 && ftruncate(out, eof) != 0) {
+        err = errno;
+    }
+    if (const int res = close_both(); res < 0 && err == 0) {
+        err = -res;
+    }
+    if (err != 0) {
+        throw_errno(err, what, source, destination);
+    }
+
+    return {
+        .strategy = copy_strategy::io_uring,
+        .bytes = static_cast<uintmax_t>(eof),
+        .bytes_read = static_cast<uintmax_t>(eof),
+        .duration = std::chrono::steady_clock::now() - start,
+    };
+}
+
+}  // namespace ddb_ows